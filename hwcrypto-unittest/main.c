@@ -23,24 +23,51 @@
  * hwkey:
  * - derive twice to same result
  * - derive different, different result
+ * - derive v2 matches v1, independent output length
+ * - batch of derive and keyslot requests
  * - keyslot, invalid slot
+ * - asynchronous keyslot
+ * - opaque handle character distribution
+ * - pipelined request benchmark
  *
  * rng:
+ * - drbg port
+ * - memref fill
+ * - memref fill on the same channel after a rejected or busy request
+ * - quota
+ * - requests above the per-channel limit
+ * - throughput and latency benchmarks
+ *
+ * stats:
+ * - dump per-command statistics
+ * - dump object pool usage
  *
  */
 
 #define TLOG_TAG "hwcrypto_unittest"
 
+#include <inttypes.h>
+#include <lk/macros.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include <hwcrypto/hwcrypto_stats.h>
+#include <hwcrypto/hwkey_srv.h>
+#include <hwcrypto/hwrng_srv.h>
 #include <lib/hwkey/hwkey.h>
 #include <lib/rng/trusty_rng.h>
+#include <lib/tipc/tipc.h>
+#include <trusty/memref.h>
+#include <trusty/sys/mman.h>
+#include <trusty/time.h>
 #include <trusty_unittest.h>
 #include <uapi/err.h>
 
 #define RPMB_STORAGE_AUTH_KEY_ID "com.android.trusty.storage_auth.rpmb"
 #define HWCRYPTO_UNITTEST_KEYBOX_ID "com.android.trusty.hwcrypto.unittest.key32"
+#define HWCRYPTO_UNITTEST_ASYNC_KEYBOX_ID \
+    "com.android.trusty.hwcrypto.unittest.async_key32"
 #define HWCRYPTO_UNITTEST_DERIVED_KEYBOX_ID \
     "com.android.trusty.hwcrypto.unittest.derived_key32"
 #define HWCRYPTO_UNITTEST_OPAQUE_HANDLE_ID \
@@ -199,6 +226,171 @@ TEST_F(hwkey, derive_zero_length) {
     EXPECT_EQ(ERR_NOT_VALID, rc, "derive zero length");
 }
 
+/*
+ * Send a raw HWKEY_DERIVE request asking for @out_len bytes
+ */
+static int hwkey_derive_raw(uint32_t kdf_version,
+                            uint32_t out_len,
+                            const uint8_t* src,
+                            size_t src_len,
+                            uint8_t* dest,
+                            size_t dest_len) {
+    int rc;
+    handle_t chan;
+    uevent_t ev;
+    struct hwkey_msg req = {
+            .cmd = HWKEY_DERIVE,
+            .arg1 = kdf_version,
+            .arg2 = out_len,
+    };
+    struct hwkey_msg rsp;
+
+    rc = tipc_connect(&chan, HWKEY_PORT);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = tipc_send2(chan, &req, sizeof(req), src, src_len);
+    if (rc != (int)(sizeof(req) + src_len)) {
+        rc = rc < 0 ? rc : ERR_IO;
+        goto out;
+    }
+
+    rc = wait(chan, &ev, INFINITE_TIME);
+    if (rc < 0) {
+        goto out;
+    }
+
+    rc = tipc_recv_hdr_payload(chan, &rsp, sizeof(rsp), dest, dest_len);
+    if (rc < (int)sizeof(rsp)) {
+        rc = rc < 0 ? rc : ERR_IO;
+        goto out;
+    }
+    if (rsp.status != HWKEY_NO_ERROR || rsp.arg1 != kdf_version) {
+        rc = ERR_GENERIC;
+        goto out;
+    }
+    rc -= sizeof(rsp);
+
+out:
+    close(chan);
+    return rc;
+}
+
+TEST_F(hwkey, derive_v2) {
+    const uint8_t src_data[] = "thirtytwo-bytes-of-nonsense-data";
+    uint8_t dest_v1[32];
+    uint8_t dest_v2[sizeof(dest_v1)];
+    uint8_t dest_long[2 * sizeof(dest_v1)];
+    static const size_t size = sizeof(dest_v1);
+    uint32_t kdf_version = HWKEY_KDF_VERSION_1;
+
+    long rc = hwkey_derive(_state->hwkey_session, &kdf_version, src_data,
+                           dest_v1, size);
+    EXPECT_EQ(NO_ERROR, rc, "derive v2 - v1 derivation");
+
+    kdf_version = HWKEY_KDF_VERSION_2;
+    rc = hwkey_derive(_state->hwkey_session, &kdf_version, src_data, dest_v2,
+                      size);
+    EXPECT_EQ(NO_ERROR, rc, "derive v2 - v2 derivation");
+    EXPECT_EQ(HWKEY_KDF_VERSION_2, kdf_version, "derive v2 - kdf version");
+
+    /* same length, same key */
+    rc = memcmp(dest_v1, dest_v2, size);
+    EXPECT_EQ(0, rc, "derive v2 - equal to v1");
+
+    /* output length does not depend on the input length */
+    rc = hwkey_derive_raw(HWKEY_KDF_VERSION_2, sizeof(dest_long), src_data,
+                          size, dest_long, sizeof(dest_long));
+    EXPECT_EQ((int)sizeof(dest_long), rc, "derive v2 - long derivation");
+
+    rc = memcmp(dest_v2, dest_long, size);
+    EXPECT_EQ(0, rc, "derive v2 - prefix of long key");
+}
+
+/*
+ * Append a sub-request to the batch in @buf at @pos
+ */
+static size_t hwkey_batch_add(uint8_t* buf,
+                              size_t pos,
+                              uint32_t cmd,
+                              uint32_t arg1,
+                              uint32_t arg2,
+                              const void* data,
+                              uint32_t len) {
+    struct hwkey_batch_entry entry = {
+            .cmd = cmd,
+            .arg1 = arg1,
+            .arg2 = arg2,
+            .len = len,
+    };
+
+    memcpy(buf + pos, &entry, sizeof(entry));
+    memcpy(buf + pos + sizeof(entry), data, len);
+    return pos + sizeof(entry) + ((len + 3) & ~3U);
+}
+
+TEST_F(hwkey, batch) {
+    int rc;
+    handle_t chan = INVALID_IPC_HANDLE;
+    uevent_t ev;
+    const uint8_t src_data[] = "thirtytwo-bytes-of-nonsense-data";
+    static const char missing_id[] = "com.android.trusty.hwcrypto.missing";
+    uint8_t dest[32];
+    uint32_t kdf_version = HWKEY_KDF_VERSION_1;
+    static uint8_t buf[HWKEY_MAX_PAYLOAD_SIZE];
+    struct hwkey_msg hdr = {.cmd = HWKEY_BATCH, .arg1 = 3};
+    struct hwkey_batch_entry entry;
+    size_t pos = 0;
+
+    long lrc = hwkey_derive(_state->hwkey_session, &kdf_version, src_data,
+                            dest, sizeof(dest));
+    ASSERT_EQ(NO_ERROR, lrc, "batch - single derivation");
+
+    memset(buf, 0, sizeof(buf));
+    pos = hwkey_batch_add(buf, pos, HWKEY_DERIVE, HWKEY_KDF_VERSION_1, 0,
+                          src_data, sizeof(dest));
+    pos = hwkey_batch_add(buf, pos, HWKEY_GET_KEYSLOT, 0, 0, missing_id,
+                          sizeof(missing_id));
+    pos = hwkey_batch_add(buf, pos, HWKEY_DERIVE, HWKEY_KDF_VERSION_1, 0,
+                          src_data, 0);
+
+    rc = tipc_connect(&chan, HWKEY_PORT);
+    ASSERT_EQ(NO_ERROR, rc, "connect");
+    rc = tipc_send2(chan, &hdr, sizeof(hdr), buf, pos);
+    ASSERT_EQ((int)(sizeof(hdr) + pos), rc, "send batch");
+    rc = wait(chan, &ev, INFINITE_TIME);
+    ASSERT_EQ(NO_ERROR, rc, "wait");
+    rc = tipc_recv_hdr_payload(chan, &hdr, sizeof(hdr), buf, sizeof(buf));
+    ASSERT_GE(rc, (int)sizeof(hdr), "recv batch");
+    EXPECT_EQ(HWKEY_NO_ERROR, hdr.status, "batch status");
+    EXPECT_EQ(3, hdr.arg1, "batch count");
+
+    /* one round trip gives the same key as a single request */
+    pos = 0;
+    memcpy(&entry, buf + pos, sizeof(entry));
+    EXPECT_EQ(HWKEY_DERIVE | HWKEY_RESP_BIT, entry.cmd, "derive entry");
+    EXPECT_EQ(HWKEY_NO_ERROR, entry.status, "derive entry status");
+    EXPECT_EQ(sizeof(dest), entry.len, "derive entry length");
+    rc = memcmp(dest, buf + pos + sizeof(entry), sizeof(dest));
+    EXPECT_EQ(0, rc, "derive entry key");
+
+    /* a failed entry does not fail the others */
+    pos += sizeof(entry) + sizeof(dest);
+    memcpy(&entry, buf + pos, sizeof(entry));
+    EXPECT_EQ(HWKEY_GET_KEYSLOT | HWKEY_RESP_BIT, entry.cmd, "keyslot entry");
+    EXPECT_EQ(HWKEY_ERR_NOT_FOUND, entry.status, "keyslot entry status");
+    EXPECT_EQ(0, entry.len, "keyslot entry length");
+
+    pos += sizeof(entry);
+    memcpy(&entry, buf + pos, sizeof(entry));
+    EXPECT_EQ(HWKEY_ERR_BAD_LEN, entry.status, "empty derive entry status");
+
+test_abort:
+    memset(buf, 0, sizeof(buf));
+    close(chan);
+}
+
 TEST_F(hwkey, get_storage_auth) {
     uint32_t actual_size = STORAGE_AUTH_KEY_SIZE;
     uint8_t storage_auth_key[STORAGE_AUTH_KEY_SIZE];
@@ -224,6 +416,23 @@ TEST_F(hwkey, get_keybox) {
 #endif
 }
 
+TEST_F(hwkey, get_async_keybox) {
+    uint8_t dest[sizeof(HWCRYPTO_UNITTEST_ASYNC_KEYBOX_ID)];
+    uint32_t actual_size = sizeof(dest);
+    long rc = hwkey_get_keyslot_data(_state->hwkey_session,
+                                     HWCRYPTO_UNITTEST_ASYNC_KEYBOX_ID, dest,
+                                     &actual_size);
+
+#if WITH_HWCRYPTO_UNITTEST
+    EXPECT_EQ(NO_ERROR, rc, "get hwcrypto-unittest async keybox");
+    EXPECT_EQ(sizeof(UNITTEST_KEYSLOT) - 1, actual_size, "async key length");
+    rc = memcmp(UNITTEST_KEYSLOT, dest, sizeof(UNITTEST_KEYSLOT) - 1);
+    EXPECT_EQ(0, rc, "get async key invalid");
+#else
+    EXPECT_EQ(ERR_NOT_FOUND, rc, "get hwcrypto-unittest async keybox");
+#endif
+}
+
 /*
  * The derived key slot should return UNITTEST_DERIVED_KEYSLOT after decrypting
  * it with the UNITTEST_KEYSLOT key.
@@ -245,6 +454,26 @@ TEST_F(hwkey, get_derived_keybox) {
 #endif
 }
 
+/*
+ * The second request for the derived key is served from the cache of unwrapped
+ * keys and must return the same key.
+ */
+TEST_F(hwkey, DISABLED_WITHOUT_HWCRYPTO_UNITTEST(get_derived_keybox_cached)) {
+    uint8_t dest[sizeof(UNITTEST_DERIVED_KEYSLOT) - 1];
+
+    for (int i = 0; i < 2; i++) {
+        uint32_t actual_size = sizeof(dest);
+        memset(dest, 0, sizeof(dest));
+        long rc = hwkey_get_keyslot_data(_state->hwkey_session,
+                                         HWCRYPTO_UNITTEST_DERIVED_KEYBOX_ID,
+                                         dest, &actual_size);
+        EXPECT_EQ(NO_ERROR, rc, "get hwcrypto-unittest derived keybox");
+        EXPECT_EQ(sizeof(dest), actual_size, "derived key length");
+        rc = memcmp(UNITTEST_DERIVED_KEYSLOT, dest, sizeof(dest));
+        EXPECT_EQ(0, rc, "get derived invalid");
+    }
+}
+
 TEST_F(hwkey, get_opaque_handle) {
     uint8_t dest[HWKEY_OPAQUE_HANDLE_MAX_SIZE] = {0};
     uint32_t actual_size = sizeof(dest);
@@ -490,6 +719,57 @@ TEST_F(hwkey, DISABLED_WITHOUT_HWCRYPTO_UNITTEST(get_opaque_derived_key)) {
     EXPECT_EQ(0, rc, "get derived invalid");
 }
 
+#define TOKEN_TEST_ROUNDS 256
+/* chi-square bound for 254 degrees of freedom, about 6 sigma above the mean */
+#define TOKEN_TEST_MAX_CHI2 390
+
+/*
+ * Opaque handle characters must be spread evenly over the 255 non-zero byte
+ * values. Every session gets a fresh handle for the same slot, as handles are
+ * dropped when their session closes.
+ */
+TEST_F(hwkey, DISABLED_WITHOUT_HWCRYPTO_UNITTEST(opaque_handle_distribution)) {
+    static uint32_t hist[256];
+    uint64_t cnt = 0;
+
+    memset(hist, 0, sizeof(hist));
+    for (int i = 0; i < TOKEN_TEST_ROUNDS; i++) {
+        uint8_t handle[HWKEY_OPAQUE_HANDLE_MAX_SIZE] = {0};
+        uint32_t actual_size = sizeof(handle);
+
+        int sess = hwkey_open();
+        ASSERT_GE(sess, 0);
+        long rc = hwkey_get_keyslot_data((hwkey_session_t)sess,
+                                         HWCRYPTO_UNITTEST_OPAQUE_HANDLE2_ID,
+                                         handle, &actual_size);
+        hwkey_close((hwkey_session_t)sess);
+        ASSERT_EQ(NO_ERROR, rc, "get hwcrypto-unittest opaque keybox");
+        ASSERT_GT(actual_size, 1);
+        EXPECT_EQ(0, handle[actual_size - 1], "handle terminator");
+
+        for (uint32_t j = 0; j < actual_size - 1; j++) {
+            hist[handle[j]]++;
+            cnt++;
+        }
+    }
+
+    EXPECT_EQ(0, hist[0], "zero byte inside handle");
+
+    /* chi2 = sum((o - e)^2 / e) with e = cnt / 255 */
+    uint64_t sum = 0;
+    for (int i = 1; i < 256; i++) {
+        int64_t d = (int64_t)hist[i] * 255 - (int64_t)cnt;
+        sum += (uint64_t)(d * d);
+    }
+    uint64_t chi2 = sum / (255 * cnt);
+    fprintf(stderr, "opaque handle chi2 %" PRIu64 " over %" PRIu64
+                    " characters\n",
+            chi2, cnt);
+    EXPECT_LT(chi2, TOKEN_TEST_MAX_CHI2, "handle characters not uniform");
+
+test_abort:;
+}
+
 /***********************   HWRNG  UNITTEST  ***********************/
 
 static uint32_t _hist[256];
@@ -586,4 +866,720 @@ TEST(hwrng, stats_test) {
     EXPECT_GT(50, dev, "average dev");
 }
 
+/*
+ * Request @len bytes from an HWRNG-protocol @port and read all replies
+ *
+ * If @len is larger than @buf_size, every reply overwrites the previous one
+ * at the start of @buf, which is enough to count the bytes.
+ */
+static int hwrng_read_port(const char* port,
+                           uint8_t* buf,
+                           size_t buf_size,
+                           size_t len) {
+    int rc;
+    handle_t chan;
+    struct hwrng_req req = {.len = len};
+
+    rc = tipc_connect(&chan, port);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = tipc_send1(chan, &req, sizeof(req));
+    if (rc != (int)sizeof(req)) {
+        rc = rc < 0 ? rc : ERR_IO;
+        goto out;
+    }
+
+    for (size_t received = 0; received < len; received += (size_t)rc) {
+        uevent_t ev;
+        rc = wait(chan, &ev, INFINITE_TIME);
+        if (rc < 0) {
+            goto out;
+        }
+
+        uint8_t* dst = buf;
+        size_t room = MIN(buf_size, len - received);
+        if (len <= buf_size) {
+            dst += received;
+            room = len - received;
+        }
+
+        rc = tipc_recv1(chan, 1, dst, room);
+        if (rc < 0) {
+            goto out;
+        }
+    }
+    rc = NO_ERROR;
+
+out:
+    close(chan);
+    return rc;
+}
+
+TEST(hwrng, drbg_port_test) {
+    int rc;
+    uint8_t zero[32] = {0};
+
+    memset(_rng_buf, 0, sizeof(_rng_buf));
+    rc = hwrng_read_port(HWRNG_DRBG_PORT, _rng_buf, sizeof(_rng_buf),
+                         sizeof(_rng_buf));
+    EXPECT_EQ(NO_ERROR, rc, "drbg request");
+
+    /* the tail of the buffer must have been filled in as well */
+    rc = memcmp(_rng_buf + sizeof(_rng_buf) - sizeof(zero), zero,
+                sizeof(zero));
+    EXPECT_NE(0, rc, "drbg output");
+}
+
+TEST(hwrng, quota_test) {
+    int rc;
+    handle_t chan;
+    uevent_t ev;
+    struct hwrng_req req = {.len = UINT32_MAX};
+
+    rc = tipc_connect(&chan, HWRNG_PORT);
+    ASSERT_EQ(NO_ERROR, rc, "connect");
+
+    /* no quota can be large enough, the service must hang up on us */
+    rc = tipc_send1(chan, &req, sizeof(req));
+    EXPECT_EQ((int)sizeof(req), rc, "oversized request");
+    rc = wait(chan, &ev, INFINITE_TIME);
+    EXPECT_EQ(NO_ERROR, rc, "wait");
+    EXPECT_NE(0, ev.event & IPC_HANDLE_POLL_HUP, "channel closed");
+
+    close(chan);
+test_abort:;
+}
+
+#define LARGE_REQ_LEN (HWRNG_MEMREF_MAX_SIZE + 1)
+#define LARGE_REQ_CNT 2
+
+static uint8_t _large_req_buf[4096];
+
+TEST(hwrng, large_req_test) {
+    int rc;
+    handle_t chan = INVALID_IPC_HANDLE;
+    struct hwrng_req req = {.len = LARGE_REQ_LEN};
+    size_t total = (size_t)LARGE_REQ_LEN * LARGE_REQ_CNT;
+    size_t received = 0;
+
+    rc = tipc_connect(&chan, HWRNG_PORT);
+    ASSERT_EQ(NO_ERROR, rc, "connect");
+
+    /*
+     * A single request above the per-channel limit must be served, and the
+     * one behind it must wait unread instead of closing the channel.
+     */
+    for (int i = 0; i < LARGE_REQ_CNT; i++) {
+        rc = tipc_send1(chan, &req, sizeof(req));
+        ASSERT_EQ((int)sizeof(req), rc, "large request");
+    }
+
+    while (received < total) {
+        uevent_t ev;
+
+        rc = wait(chan, &ev, INFINITE_TIME);
+        ASSERT_EQ(NO_ERROR, rc, "wait");
+        ASSERT_EQ(0, ev.event & IPC_HANDLE_POLL_HUP, "channel open");
+
+        rc = tipc_recv1(chan, 1, _large_req_buf,
+                        MIN(sizeof(_large_req_buf), total - received));
+        ASSERT_GT(rc, 0, "large request data");
+        received += (size_t)rc;
+    }
+    EXPECT_EQ(total, received, "large request bytes");
+
+test_abort:
+    close(chan);
+}
+
+#define MEMREF_FILL_PAGES 4
+#define MEMREF_FILL_PAGE_SIZE 4096
+
+static __attribute__((aligned(MEMREF_FILL_PAGE_SIZE)))
+uint8_t _fill_buf[MEMREF_FILL_PAGES * MEMREF_FILL_PAGE_SIZE];
+
+/*
+ * Ask the HWRNG service on @chan to fill _fill_buf in place
+ */
+static int hwrng_memref_fill_chan(handle_t chan, size_t len) {
+    int rc;
+    handle_t memref;
+    struct hwrng_memref_req req = {.len = len};
+    struct hwrng_memref_rsp rsp;
+
+    rc = memref_create(_fill_buf, sizeof(_fill_buf),
+                       MMAP_FLAG_PROT_READ | MMAP_FLAG_PROT_WRITE);
+    if (rc < 0) {
+        return rc;
+    }
+    memref = (handle_t)rc;
+
+    struct iovec iov = {
+            .iov_base = &req,
+            .iov_len = sizeof(req),
+    };
+    ipc_msg_t msg = {
+            .iov = &iov,
+            .num_iov = 1,
+            .handles = &memref,
+            .num_handles = 1,
+    };
+    rc = send_msg(chan, &msg);
+    if (rc != (int)sizeof(req)) {
+        rc = rc < 0 ? rc : ERR_IO;
+        goto out;
+    }
+
+    uevent_t ev;
+    rc = wait(chan, &ev, INFINITE_TIME);
+    if (rc < 0) {
+        goto out;
+    }
+
+    rc = tipc_recv1(chan, sizeof(rsp), &rsp, sizeof(rsp));
+    if (rc < 0) {
+        goto out;
+    }
+
+    rc = rsp.status;
+    if (rc == NO_ERROR && rsp.len != len) {
+        rc = ERR_BAD_LEN;
+    }
+
+out:
+    close(memref);
+    return rc;
+}
+
+/*
+ * Ask an HWRNG-protocol @port to fill _fill_buf in place
+ */
+static int hwrng_memref_fill(const char* port, size_t len) {
+    int rc;
+    handle_t chan;
+
+    rc = tipc_connect(&chan, port);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = hwrng_memref_fill_chan(chan, len);
+    close(chan);
+    return rc;
+}
+
+TEST(hwrng, memref_fill_test) {
+    int rc;
+    uint8_t zero[32] = {0};
+
+    memset(_fill_buf, 0, sizeof(_fill_buf));
+    rc = hwrng_memref_fill(HWRNG_PORT, sizeof(_fill_buf));
+    EXPECT_EQ(NO_ERROR, rc, "memref fill");
+    rc = memcmp(_fill_buf + sizeof(_fill_buf) - sizeof(zero), zero,
+                sizeof(zero));
+    EXPECT_NE(0, rc, "memref fill output");
+
+    memset(_fill_buf, 0, sizeof(_fill_buf));
+    rc = hwrng_memref_fill(HWRNG_DRBG_PORT, sizeof(_fill_buf));
+    EXPECT_EQ(NO_ERROR, rc, "drbg memref fill");
+    rc = memcmp(_fill_buf + sizeof(_fill_buf) - sizeof(zero), zero,
+                sizeof(zero));
+    EXPECT_NE(0, rc, "drbg memref fill output");
+
+    /* requests above HWRNG_MEMREF_MAX_SIZE must be rejected */
+    rc = hwrng_memref_fill(HWRNG_PORT, HWRNG_MEMREF_MAX_SIZE + 1);
+    EXPECT_EQ(ERR_INVALID_ARGS, rc, "oversized memref fill");
+
+    /* a rejected request must not cost the client its channel */
+    handle_t chan;
+    rc = tipc_connect(&chan, HWRNG_PORT);
+    ASSERT_EQ(NO_ERROR, rc, "connect");
+    rc = hwrng_memref_fill_chan(chan, HWRNG_MEMREF_MAX_SIZE + 1);
+    EXPECT_EQ(ERR_INVALID_ARGS, rc, "oversized memref fill");
+    rc = hwrng_memref_fill_chan(chan, sizeof(_fill_buf));
+    EXPECT_EQ(NO_ERROR, rc, "memref fill after rejected request");
+    close(chan);
+
+test_abort:;
+}
+
+#define MEMREF_BUSY_MAX_HOGS 16
+#define MEMREF_BUSY_RETRIES 100
+#define MEMREF_BUSY_RETRY_NS (1000ULL * 1000ULL)
+
+TEST(hwrng, memref_busy_test) {
+    int rc;
+    handle_t chan;
+    handle_t hogs[MEMREF_BUSY_MAX_HOGS];
+    size_t hog_cnt = 0;
+    bool quota_full = false;
+    struct hwrng_req hog_req = {.len = HWRNG_MEMREF_MAX_SIZE};
+
+    /*
+     * Use up the quota with requests that are never read. The service hangs
+     * up on the first plain request it cannot admit.
+     */
+    while (!quota_full && hog_cnt < countof(hogs)) {
+        handle_t hog;
+        uevent_t ev;
+
+        rc = tipc_connect(&hog, HWRNG_PORT);
+        ASSERT_EQ(NO_ERROR, rc, "connect hog");
+        hogs[hog_cnt++] = hog;
+
+        rc = tipc_send1(hog, &hog_req, sizeof(hog_req));
+        ASSERT_EQ((int)sizeof(hog_req), rc, "hog request");
+
+        /* the first reply or the hangup tells us the request was handled */
+        rc = wait(hog, &ev, INFINITE_TIME);
+        ASSERT_EQ(NO_ERROR, rc, "wait hog");
+        quota_full = ev.event & IPC_HANDLE_POLL_HUP;
+    }
+    ASSERT_EQ(true, quota_full, "quota exhausted");
+
+    rc = tipc_connect(&chan, HWRNG_PORT);
+    ASSERT_EQ(NO_ERROR, rc, "connect");
+
+    rc = hwrng_memref_fill_chan(chan, HWRNG_MEMREF_MAX_SIZE);
+    EXPECT_EQ(ERR_BUSY, rc, "memref fill over quota");
+
+    for (size_t i = 0; i < hog_cnt; i++) {
+        close(hogs[i]);
+    }
+    hog_cnt = 0;
+
+    /*
+     * The same channel must be served once the quota is released. The
+     * service may see the request before the hangups of the hogs, so retry
+     * while it is still busy.
+     */
+    for (int i = 0; i < MEMREF_BUSY_RETRIES; i++) {
+        rc = hwrng_memref_fill_chan(chan, sizeof(_fill_buf));
+        if (rc != ERR_BUSY) {
+            break;
+        }
+        trusty_nanosleep(0, 0, MEMREF_BUSY_RETRY_NS);
+    }
+    EXPECT_EQ(NO_ERROR, rc, "memref fill after busy");
+
+    close(chan);
+
+test_abort:
+    for (size_t i = 0; i < hog_cnt; i++) {
+        close(hogs[i]);
+    }
+}
+
+/*
+ * Benchmarks. Every result is printed as a single line starting with
+ * "hwrng_bench" or "hwkey_bench" followed by space separated key=value pairs,
+ * so CI can pick them out of the log and compare them between builds.
+ */
+
+#define BENCH_MIN_SIZE 16
+#define BENCH_MAX_SIZE (1024 * 1024)
+#define BENCH_TARGET_BYTES (1024 * 1024)
+#define BENCH_MIN_ITERS 4
+#define BENCH_MAX_ITERS 256
+
+/*
+ * Requests larger than the buffer are read into it one reply at a time, so
+ * the benchmark does not need a heap the size of its largest request.
+ */
+#define BENCH_BUF_SIZE (64 * 1024)
+
+static uint8_t _bench_buf[BENCH_BUF_SIZE];
+
+static int64_t bench_now(void) {
+    int64_t now = 0;
+    trusty_gettime(0, &now);
+    return now;
+}
+
+/*
+ * Time back to back requests of @size bytes on @port, each on a new session
+ * the way trusty_rng_hw_rand() does it. trusty_rng_hw_rand() needs a buffer
+ * for the whole request, larger ones are read with hwrng_read_port(), which
+ * sends the same messages.
+ */
+static int bench_run_throughput(const char* port, size_t size) {
+    int rc = NO_ERROR;
+    uint32_t iters = BENCH_TARGET_BYTES / size;
+
+    iters = MIN(MAX(iters, BENCH_MIN_ITERS), BENCH_MAX_ITERS);
+
+    int64_t start = bench_now();
+    for (uint32_t i = 0; i < iters && rc == NO_ERROR; i++) {
+        if (!strcmp(port, HWRNG_PORT) && size <= sizeof(_bench_buf)) {
+            rc = trusty_rng_hw_rand(_bench_buf, size);
+        } else {
+            rc = hwrng_read_port(port, _bench_buf, sizeof(_bench_buf), size);
+        }
+    }
+    int64_t ns = MAX(bench_now() - start, 1);
+
+    if (rc == NO_ERROR) {
+        fprintf(stderr,
+                "hwrng_bench test=throughput port=%s size=%zu iters=%u "
+                "ns_per_req=%" PRId64 " bytes_per_sec=%" PRIu64 "\n",
+                port, size, iters, ns / iters,
+                (uint64_t)size * iters * 1000000000ULL / (uint64_t)ns);
+    }
+    return rc;
+}
+
+TEST(hwrng, bench_throughput) {
+    int rc;
+
+    for (size_t size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 4) {
+        rc = bench_run_throughput(HWRNG_PORT, size);
+        EXPECT_EQ(NO_ERROR, rc, "hwrng throughput %zu", size);
+        rc = bench_run_throughput(HWRNG_DRBG_PORT, size);
+        EXPECT_EQ(NO_ERROR, rc, "drbg throughput %zu", size);
+    }
+}
+
+#define BENCH_MAX_SESSIONS 8
+#define BENCH_LAT_REQS 64
+#define BENCH_LAT_SIZE 256
+
+/**
+ * struct bench_session - one closed-loop client of the latency benchmark
+ * @chan:     connection to the HWRNG port
+ * @sent_ns:  time the outstanding request was sent
+ * @received: bytes of the outstanding request received so far
+ * @done:     number of completed requests
+ */
+struct bench_session {
+    handle_t chan;
+    int64_t sent_ns;
+    size_t received;
+    uint32_t done;
+};
+
+static struct bench_session _sessions[BENCH_MAX_SESSIONS];
+static int64_t _latency_ns[BENCH_MAX_SESSIONS * BENCH_LAT_REQS];
+
+static int cmp_int64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a;
+    int64_t y = *(const int64_t*)b;
+    return (x > y) - (x < y);
+}
+
+static int bench_session_send(struct bench_session* s) {
+    struct hwrng_req req = {.len = BENCH_LAT_SIZE};
+
+    s->received = 0;
+    s->sent_ns = bench_now();
+    int rc = tipc_send1(s->chan, &req, sizeof(req));
+    if (rc < 0) {
+        return rc;
+    }
+    return rc == (int)sizeof(req) ? NO_ERROR : ERR_IO;
+}
+
+/*
+ * Keep @nsessions requests outstanding at all times and record how long each
+ * one takes to be served
+ */
+static int bench_run_latency(uint32_t nsessions) {
+    int rc;
+    uint8_t buf[BENCH_LAT_SIZE];
+    uint32_t count = 0;
+    uint32_t opened = 0;
+
+    int hset = handle_set_create();
+    if (hset < 0) {
+        return hset;
+    }
+
+    for (; opened < nsessions; opened++) {
+        struct bench_session* s = &_sessions[opened];
+
+        memset(s, 0, sizeof(*s));
+        rc = tipc_connect(&s->chan, HWRNG_PORT);
+        if (rc < 0) {
+            goto out;
+        }
+
+        uevent_t uevt = {
+                .handle = s->chan,
+                .event = ~0U,
+                .cookie = s,
+        };
+        rc = handle_set_ctrl((handle_t)hset, HSET_ADD, &uevt);
+        if (rc < 0) {
+            close(s->chan);
+            goto out;
+        }
+    }
+
+    for (uint32_t i = 0; i < nsessions; i++) {
+        rc = bench_session_send(&_sessions[i]);
+        if (rc < 0) {
+            goto out;
+        }
+    }
+
+    while (count < nsessions * BENCH_LAT_REQS) {
+        uevent_t ev;
+        rc = wait((handle_t)hset, &ev, INFINITE_TIME);
+        if (rc < 0) {
+            goto out;
+        }
+
+        struct bench_session* s = ev.cookie;
+        if (ev.event & IPC_HANDLE_POLL_HUP) {
+            rc = ERR_IO;
+            goto out;
+        }
+        if (!(ev.event & IPC_HANDLE_POLL_MSG)) {
+            continue;
+        }
+
+        rc = tipc_recv1(s->chan, 1, buf, sizeof(buf));
+        if (rc < 0) {
+            goto out;
+        }
+        s->received += (size_t)rc;
+        if (s->received < BENCH_LAT_SIZE) {
+            continue;
+        }
+
+        _latency_ns[count++] = bench_now() - s->sent_ns;
+        if (++s->done < BENCH_LAT_REQS) {
+            rc = bench_session_send(s);
+            if (rc < 0) {
+                goto out;
+            }
+        }
+    }
+
+    qsort(_latency_ns, count, sizeof(_latency_ns[0]), cmp_int64);
+    fprintf(stderr,
+            "hwrng_bench test=latency port=%s sessions=%u size=%u reqs=%u "
+            "p50_ns=%" PRId64 " p90_ns=%" PRId64 " p99_ns=%" PRId64
+            " max_ns=%" PRId64 "\n",
+            HWRNG_PORT, nsessions, BENCH_LAT_SIZE, count,
+            _latency_ns[count / 2], _latency_ns[count * 90 / 100],
+            _latency_ns[count * 99 / 100], _latency_ns[count - 1]);
+    rc = NO_ERROR;
+
+out:
+    while (opened--) {
+        close(_sessions[opened].chan);
+    }
+    close((handle_t)hset);
+    return rc;
+}
+
+TEST(hwrng, bench_latency) {
+    int rc;
+
+    for (uint32_t n = 1; n <= BENCH_MAX_SESSIONS; n *= 2) {
+        rc = bench_run_latency(n);
+        EXPECT_EQ(NO_ERROR, rc, "latency with %u sessions", n);
+    }
+}
+
+#define BENCH_MAX_DEPTH 8
+#define BENCH_PIPE_REQS 256
+
+/*
+ * Time BENCH_PIPE_REQS key derivations on one hwkey session, keeping up to
+ * @depth requests in flight. The achieved depth is limited by the queue
+ * length of the port.
+ */
+static int bench_run_pipelined(uint32_t depth) {
+    int rc;
+    handle_t chan;
+    uevent_t ev;
+    const uint8_t src_data[] = "thirtytwo-bytes-of-nonsense-data";
+    uint8_t dest[32];
+    struct hwkey_msg req = {
+            .cmd = HWKEY_DERIVE,
+            .arg1 = HWKEY_KDF_VERSION_BEST,
+    };
+    struct hwkey_msg rsp;
+    uint32_t sent = 0;
+    uint32_t done = 0;
+    uint32_t max_inflight = 0;
+
+    rc = tipc_connect(&chan, HWKEY_PORT);
+    if (rc < 0) {
+        return rc;
+    }
+
+    int64_t start = bench_now();
+    while (done < BENCH_PIPE_REQS) {
+        while (sent - done < depth && sent < BENCH_PIPE_REQS) {
+            rc = tipc_send2(chan, &req, sizeof(req), src_data, sizeof(dest));
+            if (rc == ERR_NOT_ENOUGH_BUFFER) {
+                break; /* the port queue is full */
+            } else if (rc < 0) {
+                goto out;
+            }
+            sent++;
+            max_inflight = MAX(max_inflight, sent - done);
+        }
+
+        rc = wait(chan, &ev, INFINITE_TIME);
+        if (rc < 0) {
+            goto out;
+        }
+        if (ev.event & IPC_HANDLE_POLL_HUP) {
+            rc = ERR_CHANNEL_CLOSED;
+            goto out;
+        }
+        if (!(ev.event & IPC_HANDLE_POLL_MSG)) {
+            continue;
+        }
+
+        rc = tipc_recv_hdr_payload(chan, &rsp, sizeof(rsp), dest,
+                                   sizeof(dest));
+        if (rc < 0) {
+            goto out;
+        }
+        if (rsp.status != HWKEY_NO_ERROR) {
+            rc = ERR_GENERIC;
+            goto out;
+        }
+        done++;
+    }
+    int64_t ns = MAX(bench_now() - start, 1);
+
+    fprintf(stderr,
+            "hwkey_bench test=pipelined port=%s depth=%u max_inflight=%u "
+            "reqs=%u ns_per_req=%" PRId64 " reqs_per_sec=%" PRIu64 "\n",
+            HWKEY_PORT, depth, max_inflight, done, ns / done,
+            (uint64_t)done * 1000000000ULL / (uint64_t)ns);
+    rc = NO_ERROR;
+
+out:
+    close(chan);
+    return rc;
+}
+
+TEST_F(hwkey, bench_pipelined) {
+    int rc;
+
+    for (uint32_t depth = 1; depth <= BENCH_MAX_DEPTH; depth *= 2) {
+        rc = bench_run_pipelined(depth);
+        EXPECT_EQ(NO_ERROR, rc, "pipelined with depth %u", depth);
+    }
+}
+
+/***********************   STATS  UNITTEST  ***********************/
+
+static const char* const stats_names[HWCRYPTO_STATS_COUNT] = {
+        [HWCRYPTO_STATS_HWRNG_GET] = "hwrng_get",
+        [HWCRYPTO_STATS_HWRNG_DRBG] = "hwrng_drbg",
+        [HWCRYPTO_STATS_HWRNG_MEMREF] = "hwrng_memref",
+        [HWCRYPTO_STATS_HWKEY_GET_KEYSLOT] = "hwkey_get_keyslot",
+        [HWCRYPTO_STATS_HWKEY_DERIVE] = "hwkey_derive",
+        [HWCRYPTO_STATS_HWKEY_BATCH] = "hwkey_batch",
+        [HWCRYPTO_STATS_KEYBOX_UNWRAP] = "keybox_unwrap",
+};
+
+static int stats_get(handle_t chan, uint32_t id, void* rsp, size_t rsp_size) {
+    int rc;
+    uevent_t ev;
+    struct hwcrypto_stats_req req = {.id = id};
+
+    rc = tipc_send1(chan, &req, sizeof(req));
+    if (rc != (int)sizeof(req)) {
+        return rc < 0 ? rc : ERR_IO;
+    }
+
+    rc = wait(chan, &ev, INFINITE_TIME);
+    if (rc < 0) {
+        return rc;
+    }
+
+    rc = tipc_recv1(chan, rsp_size, rsp, rsp_size);
+    return rc < 0 ? rc : NO_ERROR;
+}
+
+TEST(hwcrypto, stats_dump) {
+    int rc;
+    handle_t chan = INVALID_IPC_HANDLE;
+    struct hwcrypto_stats_rsp rsp;
+    uint8_t buf[32];
+
+    /* make sure there is at least one sample to report */
+    rc = trusty_rng_hw_rand(buf, sizeof(buf));
+    ASSERT_EQ(NO_ERROR, rc, "hwrng request");
+
+    rc = tipc_connect(&chan, HWCRYPTO_STATS_PORT);
+    ASSERT_EQ(NO_ERROR, rc, "connect");
+
+    for (uint32_t id = 0; id < HWCRYPTO_STATS_COUNT; id++) {
+        rc = stats_get(chan, id, &rsp, sizeof(rsp));
+        ASSERT_EQ(NO_ERROR, rc, "stats of %s", stats_names[id]);
+        EXPECT_EQ(NO_ERROR, rsp.status, "status of %s", stats_names[id]);
+        EXPECT_EQ(id, rsp.id, "id of %s", stats_names[id]);
+
+        uint64_t hist_cnt = 0;
+        for (uint32_t b = 0; b < HWCRYPTO_STATS_HIST_BUCKETS; b++) {
+            hist_cnt += rsp.hist[b];
+        }
+        EXPECT_EQ(rsp.count, hist_cnt, "histogram of %s", stats_names[id]);
+
+        fprintf(stderr,
+                "hwcrypto_stats cmd=%s count=%" PRIu64 " errors=%" PRIu64
+                " bytes=%" PRIu64 " avg_ns=%" PRIu64 " max_ns=%" PRIu64 "\n",
+                stats_names[id], rsp.count, rsp.errors, rsp.bytes,
+                rsp.count ? rsp.total_ns / rsp.count : 0, rsp.max_ns);
+        for (uint32_t b = 0; b < HWCRYPTO_STATS_HIST_BUCKETS; b++) {
+            if (rsp.hist[b]) {
+                fprintf(stderr,
+                        "hwcrypto_stats cmd=%s min_us=%u count=%" PRIu32 "\n",
+                        stats_names[id], b ? 1U << b : 0, rsp.hist[b]);
+            }
+        }
+
+        if (id == HWCRYPTO_STATS_HWRNG_GET) {
+            EXPECT_GT(rsp.count, 0, "hwrng request recorded");
+        }
+    }
+
+    /* unknown commands are rejected without closing the channel */
+    rc = stats_get(chan, HWCRYPTO_STATS_COUNT, &rsp, sizeof(rsp));
+    EXPECT_EQ(NO_ERROR, rc, "stats of unknown command");
+    EXPECT_EQ(ERR_NOT_FOUND, rsp.status, "status of unknown command");
+
+    /* object pools are numbered from 0, the first missing one ends the list */
+    uint32_t pool_cnt = 0;
+    for (uint32_t id = HWCRYPTO_STATS_POOL_BASE;; id++) {
+        struct hwcrypto_stats_pool_rsp pool;
+
+        rc = stats_get(chan, id, &pool, sizeof(pool));
+        ASSERT_EQ(NO_ERROR, rc, "stats of pool %u", id);
+        EXPECT_EQ(id, pool.id, "id of pool %u", id);
+        if (pool.status == ERR_NOT_FOUND) {
+            break;
+        }
+        ASSERT_EQ(NO_ERROR, pool.status, "status of pool %u", id);
+        pool_cnt++;
+
+        pool.name[sizeof(pool.name) - 1] = 0;
+        EXPECT_GE(pool.capacity, pool.high_water, "high water of %s",
+                  pool.name);
+        EXPECT_GE(pool.high_water, pool.used, "use of %s", pool.name);
+
+        fprintf(stderr,
+                "hwcrypto_stats pool=%s obj_size=%" PRIu32 " capacity=%" PRIu32
+                " used=%" PRIu32 " high_water=%" PRIu32 " failures=%" PRIu64
+                "\n",
+                pool.name, pool.obj_size, pool.capacity, pool.used,
+                pool.high_water, pool.failures);
+    }
+    EXPECT_GT(pool_cnt, 0, "object pools reported");
+
+test_abort:
+    close(chan);
+}
+
 PORT_TEST(hwcrypto, "com.android.trusty.hwcrypto.test")
@@ -22,6 +22,9 @@ MANIFEST := $(LOCAL_DIR)/manifest.json
 MODULE_SRCS += \
 	$(LOCAL_DIR)/main.c \
 
+MODULE_INCLUDES += \
+	trusty/user/app/sample/hwcrypto/include \
+
 MODULE_DEPS += \
 	$(HWCRYPTO_UNITTEST_DEVICE_MODULE) \
 
@@ -29,6 +32,7 @@ MODULE_LIBRARY_DEPS += \
 	trusty/user/base/lib/libc-trusty \
 	trusty/user/base/lib/hwkey \
 	trusty/user/base/lib/rng \
+	trusty/user/base/lib/tipc \
 	trusty/user/base/lib/unittest \
 
 ifeq (true,$(call TOBOOL,$(WITH_FAKE_HWRNG)))
@@ -0,0 +1,105 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <trusty_ipc.h>
+
+__BEGIN_CDECLS
+
+/**
+ * enum hwcrypto_event_prio - order in which ready handles are served
+ * @HWCRYPTO_EVENT_PRIO_HIGH:    small latency sensitive requests (keybox)
+ * @HWCRYPTO_EVENT_PRIO_NORMAL:  key requests (hwkey)
+ * @HWCRYPTO_EVENT_PRIO_DEFAULT: handlers that did not register a priority
+ * @HWCRYPTO_EVENT_PRIO_BULK:    bulk data (hwrng fills) and statistics
+ *
+ * The main loop collects all handles that are ready after a wakeup and serves
+ * them in this order, so a keybox request does not wait behind a batch of
+ * large hwrng requests.
+ */
+enum hwcrypto_event_prio {
+    HWCRYPTO_EVENT_PRIO_HIGH,
+    HWCRYPTO_EVENT_PRIO_NORMAL,
+    HWCRYPTO_EVENT_PRIO_DEFAULT,
+    HWCRYPTO_EVENT_PRIO_BULK,
+};
+
+/**
+ * hwcrypto_set_event_priority() - set the priority of an event handler
+ * @proc: handler procedure, as set in &struct tipc_event_handler
+ * @prio: priority of all events dispatched to @proc
+ *
+ * Events of handlers without a priority are served with
+ * %HWCRYPTO_EVENT_PRIO_DEFAULT.
+ */
+void hwcrypto_set_event_priority(void (*proc)(const uevent_t* ev, void* priv),
+                                 enum hwcrypto_event_prio prio);
+
+/**
+ * hwcrypto_cancel_events() - drop collected events of a handle
+ * @handle: handle that is about to be closed
+ *
+ * Must be called before closing a handle whose cookie is freed with it, since
+ * events of the handle may already have been collected for dispatch later in
+ * the same wakeup.
+ */
+void hwcrypto_cancel_events(handle_t handle);
+
+/**
+ * hwcrypto_get_event_stats() - get event loop statistics
+ * @wakeups: number of times the event loop woke up for at least one event
+ * @events:  number of events dispatched, @events / @wakeups is the average
+ *           number of events served per wakeup
+ */
+void hwcrypto_get_event_stats(uint64_t* wakeups, uint64_t* events);
+
+/**
+ * struct hwcrypto_self_test - known answer test run from the event loop
+ * @node: entry in the queue of pending tests
+ * @name: name used in logs
+ * @run:  the test, returns true if it passed
+ *
+ * Services create their ports before their tests have run, and the event
+ * loop runs one queued test after serving each wakeup. Ports can accept
+ * connections and unrelated services keep working in the meantime, while
+ * services whose results depend on the tests hold back requests until
+ * hwcrypto_self_tests_done() returns true. A failed test aborts hwcrypto.
+ */
+struct hwcrypto_self_test {
+    struct list_node node;
+    const char* name;
+    bool (*run)(void);
+};
+
+/**
+ * hwcrypto_queue_self_test() - queue a test behind all pending ones
+ * @test: test to queue, must stay valid until it has run
+ */
+void hwcrypto_queue_self_test(struct hwcrypto_self_test* test);
+
+/**
+ * hwcrypto_self_tests_done() - check if all queued tests have passed
+ *
+ * Return: true if no test is pending.
+ */
+bool hwcrypto_self_tests_done(void);
+
+__END_CDECLS
@@ -0,0 +1,187 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "hwkey_derived_cache"
+
+#include <assert.h>
+#include <lk/macros.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include <openssl/mem.h>
+#include <trusty/time.h>
+#include <trusty_ipc.h>
+#include <trusty_log.h>
+
+#include "hwkey_srv_priv.h"
+
+/*
+ * Number of unwrapped derived keys kept in memory. 0 disables the cache. Can
+ * be overridden from the build configuration.
+ */
+#ifndef HWKEY_DERIVED_CACHE_SIZE
+#define HWKEY_DERIVED_CACHE_SIZE 4
+#endif
+
+/*
+ * Longest time in milliseconds an unwrapped key stays in the cache, whether
+ * it is used or not. Key slots and their wrapping keys never change once
+ * installed, so expiry and LRU replacement are the only ways a key leaves the
+ * cache. Can be overridden from the build configuration.
+ */
+#ifndef HWKEY_DERIVED_CACHE_TTL_MS
+#define HWKEY_DERIVED_CACHE_TTL_MS 10000
+#endif
+
+#define HWKEY_DERIVED_CACHE_TTL_NS (HWKEY_DERIVED_CACHE_TTL_MS * 1000000LL)
+
+/* Largest unwrapped key that is cached */
+#define HWKEY_DERIVED_CACHE_KEY_SIZE 64
+
+/**
+ * struct derived_cache_entry - an unwrapped derived key
+ * @data:     key slot data the key was unwrapped from, NULL if unused
+ * @added_ns: time the key was unwrapped, the entry expires
+ *            %HWKEY_DERIVED_CACHE_TTL_MS later
+ * @used_ns:  last time the entry was used, for LRU replacement
+ * @len:      length of @key
+ * @key:      the unwrapped key
+ */
+struct derived_cache_entry {
+    const struct hwkey_derived_keyslot_data* data;
+    int64_t added_ns;
+    int64_t used_ns;
+    size_t len;
+    uint8_t key[HWKEY_DERIVED_CACHE_KEY_SIZE];
+};
+
+#if HWKEY_DERIVED_CACHE_SIZE
+
+static struct derived_cache_entry cache[HWKEY_DERIVED_CACHE_SIZE];
+
+static int64_t now_ns(void) {
+    int64_t now = 0;
+    trusty_gettime(0, &now);
+    return now;
+}
+
+static void evict(struct derived_cache_entry* entry) {
+    OPENSSL_cleanse(entry, sizeof(*entry));
+}
+
+static bool expired(const struct derived_cache_entry* entry, int64_t now) {
+    return now - entry->added_ns >= HWKEY_DERIVED_CACHE_TTL_NS;
+}
+
+uint32_t hwkey_derived_cache_get(const struct hwkey_derived_keyslot_data* data,
+                                 uint8_t* kbuf,
+                                 size_t kbuf_len,
+                                 size_t* klen) {
+    int64_t now = now_ns();
+
+    for (size_t i = 0; i < countof(cache); i++) {
+        struct derived_cache_entry* entry = &cache[i];
+
+        if (entry->data != data)
+            continue;
+
+        if (expired(entry, now)) {
+            evict(entry);
+            break;
+        }
+
+        if (kbuf_len < entry->len)
+            return HWKEY_ERR_BAD_LEN;
+
+        memcpy(kbuf, entry->key, entry->len);
+        *klen = entry->len;
+        entry->used_ns = now;
+        return HWKEY_NO_ERROR;
+    }
+
+    return HWKEY_ERR_NOT_FOUND;
+}
+
+void hwkey_derived_cache_put(const struct hwkey_derived_keyslot_data* data,
+                             const uint8_t* key,
+                             size_t len) {
+    struct derived_cache_entry* victim = &cache[0];
+
+    if (len > HWKEY_DERIVED_CACHE_KEY_SIZE)
+        return;
+
+    for (size_t i = 0; i < countof(cache); i++) {
+        struct derived_cache_entry* entry = &cache[i];
+
+        if (entry->data == data || !entry->data) {
+            victim = entry;
+            break;
+        }
+        if (entry->used_ns < victim->used_ns)
+            victim = entry;
+    }
+
+    evict(victim);
+    victim->data = data;
+    victim->added_ns = victim->used_ns = now_ns();
+    victim->len = len;
+    memcpy(victim->key, key, len);
+}
+
+uint32_t hwkey_derived_cache_expire(void) {
+    int64_t now = now_ns();
+    int64_t next = INT64_MAX;
+
+    for (size_t i = 0; i < countof(cache); i++) {
+        struct derived_cache_entry* entry = &cache[i];
+
+        if (!entry->data)
+            continue;
+
+        if (expired(entry, now)) {
+            evict(entry);
+            continue;
+        }
+        next = MIN(next, entry->added_ns + HWKEY_DERIVED_CACHE_TTL_NS - now);
+    }
+
+    if (next == INT64_MAX)
+        return INFINITE_TIME;
+
+    /* round up so we do not wake up just before the entry expires */
+    return (uint32_t)((next + 999999) / 1000000);
+}
+
+#else /* HWKEY_DERIVED_CACHE_SIZE */
+
+uint32_t hwkey_derived_cache_get(const struct hwkey_derived_keyslot_data* data,
+                                 uint8_t* kbuf,
+                                 size_t kbuf_len,
+                                 size_t* klen) {
+    return HWKEY_ERR_NOT_FOUND;
+}
+
+void hwkey_derived_cache_put(const struct hwkey_derived_keyslot_data* data,
+                             const uint8_t* key,
+                             size_t len) {}
+
+uint32_t hwkey_derived_cache_expire(void) {
+    return INFINITE_TIME;
+}
+
+#endif /* HWKEY_DERIVED_CACHE_SIZE */
@@ -0,0 +1,237 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "hwkey_slot_index"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include <trusty_log.h>
+
+#include "hwkey_srv_priv.h"
+
+/*
+ * Perfect hash index over the installed key slots, keyed by (key_id, uuid).
+ *
+ * Built once by hwkey_slot_index_build() using hash and displace: every key
+ * hashes to one of @nbuckets buckets, and each bucket gets a displacement
+ * that places all of its keys into distinct free entries of @table. A lookup
+ * is then one hash of the key, two table reads and one comparison to reject
+ * keys that are not installed at all.
+ */
+
+/* give up on a bucket after this many displacements */
+#define SLOT_INDEX_MAX_DISP 0xffff
+
+#define SLOT_INDEX_KEYS_PER_BUCKET 4
+
+static struct {
+    const struct hwkey_keyslot* slots;
+    uint32_t nbuckets;
+    uint32_t mask;
+    uint16_t* disp;
+    /* slot number + 1 for every entry, 0 if empty */
+    uint16_t* table;
+} slot_index;
+
+static uint64_t slot_hash(const char* key_id, const uuid_t* uuid) {
+    /* FNV-1a over the key id including its terminator, then the uuid */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    const uint8_t* p = (const uint8_t*)key_id;
+
+    do {
+        h ^= *p;
+        h *= 0x100000001b3ULL;
+    } while (*p++);
+
+    p = (const uint8_t*)uuid;
+    for (size_t i = 0; i < sizeof(*uuid); i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static uint32_t slot_pos(uint64_t h, uint32_t disp) {
+    /* splitmix64 finalizer to spread each displacement over the table */
+    uint64_t z = h + (disp + 1) * 0x9e3779b97f4a7c15ULL;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return (uint32_t)(z ^ (z >> 31)) & slot_index.mask;
+}
+
+static uint32_t slot_bucket(uint64_t h) {
+    return (uint32_t)(h >> 32) % slot_index.nbuckets;
+}
+
+static bool same_slot(const struct hwkey_keyslot* a,
+                      const struct hwkey_keyslot* b) {
+    return !strcmp(a->key_id, b->key_id) &&
+           !memcmp(a->uuid, b->uuid, sizeof(uuid_t));
+}
+
+/*
+ * Find a displacement for all keys in @bucket
+ */
+static bool place_bucket(uint32_t bucket,
+                         const uint64_t* hashes,
+                         const bool* indexed,
+                         unsigned int cnt) {
+    for (uint32_t d = 0; d <= SLOT_INDEX_MAX_DISP; d++) {
+        unsigned int placed = 0;
+        bool ok = true;
+
+        for (unsigned int i = 0; i < cnt && ok; i++) {
+            if (!indexed[i] || slot_bucket(hashes[i]) != bucket)
+                continue;
+
+            uint32_t pos = slot_pos(hashes[i], d);
+            if (slot_index.table[pos]) {
+                ok = false;
+                break;
+            }
+            slot_index.table[pos] = (uint16_t)(i + 1);
+            placed++;
+        }
+
+        if (ok) {
+            slot_index.disp[bucket] = (uint16_t)d;
+            return true;
+        }
+
+        /* undo the keys of this bucket placed so far */
+        for (unsigned int i = 0; i < cnt && placed; i++) {
+            if (!indexed[i] || slot_bucket(hashes[i]) != bucket)
+                continue;
+            uint32_t pos = slot_pos(hashes[i], d);
+            if (slot_index.table[pos] == i + 1) {
+                slot_index.table[pos] = 0;
+                placed--;
+            }
+        }
+    }
+    return false;
+}
+
+static void slot_index_free(void) {
+    free(slot_index.disp);
+    free(slot_index.table);
+    memset(&slot_index, 0, sizeof(slot_index));
+}
+
+int hwkey_slot_index_build(const struct hwkey_keyslot* slots,
+                           unsigned int cnt) {
+    int rc = ERR_NO_MEMORY;
+    uint64_t* hashes = NULL;
+    bool* indexed = NULL;
+    uint32_t* bucket_size = NULL;
+    uint32_t max_bucket_size = 0;
+
+    assert(slots && cnt);
+
+    if (cnt >= UINT16_MAX)
+        return ERR_TOO_BIG;
+
+    slot_index_free();
+
+    uint32_t size = 1;
+    while (size < 2 * cnt)
+        size <<= 1;
+
+    slot_index.slots = slots;
+    slot_index.mask = size - 1;
+    slot_index.nbuckets = (cnt + SLOT_INDEX_KEYS_PER_BUCKET - 1) /
+                          SLOT_INDEX_KEYS_PER_BUCKET;
+    slot_index.disp = calloc(slot_index.nbuckets, sizeof(*slot_index.disp));
+    slot_index.table = calloc(size, sizeof(*slot_index.table));
+    hashes = calloc(cnt, sizeof(*hashes));
+    indexed = calloc(cnt, sizeof(*indexed));
+    bucket_size = calloc(slot_index.nbuckets, sizeof(*bucket_size));
+    if (!slot_index.disp || !slot_index.table || !hashes || !indexed ||
+        !bucket_size)
+        goto out;
+
+    for (unsigned int i = 0; i < cnt; i++) {
+        /* slots without handler are never served, so leave them out */
+        if (!hwkey_slot_has_handler(&slots[i]))
+            continue;
+
+        /* a linear scan would always find the first of two equal slots */
+        bool dup = false;
+        for (unsigned int j = 0; j < i && !dup; j++)
+            dup = indexed[j] && same_slot(&slots[i], &slots[j]);
+        if (dup) {
+            TLOGE("duplicate key slot %s\n", slots[i].key_id);
+            continue;
+        }
+
+        indexed[i] = true;
+        hashes[i] = slot_hash(slots[i].key_id, slots[i].uuid);
+        uint32_t b = slot_bucket(hashes[i]);
+        bucket_size[b]++;
+        if (bucket_size[b] > max_bucket_size)
+            max_bucket_size = bucket_size[b];
+    }
+
+    /* place the largest buckets first while the table is still empty */
+    for (uint32_t n = max_bucket_size; n > 0; n--) {
+        for (uint32_t b = 0; b < slot_index.nbuckets; b++) {
+            if (bucket_size[b] != n)
+                continue;
+            if (!place_bucket(b, hashes, indexed, cnt)) {
+                TLOGE("failed to place key slot bucket %u\n", b);
+                rc = ERR_GENERIC;
+                goto out;
+            }
+        }
+    }
+
+    rc = NO_ERROR;
+
+out:
+    if (rc != NO_ERROR)
+        slot_index_free();
+    free(hashes);
+    free(indexed);
+    free(bucket_size);
+    return rc;
+}
+
+bool hwkey_slot_index_ready(void) {
+    return slot_index.table != NULL;
+}
+
+const struct hwkey_keyslot* hwkey_slot_index_find(const char* key_id,
+                                                  const uuid_t* uuid) {
+    assert(slot_index.table);
+
+    uint64_t h = slot_hash(key_id, uuid);
+    uint32_t disp = slot_index.disp[slot_bucket(h)];
+    uint16_t entry = slot_index.table[slot_pos(h, disp)];
+    if (!entry)
+        return NULL;
+
+    /* the caller checks the owner against its access bitmap */
+    const struct hwkey_keyslot* slot = &slot_index.slots[entry - 1];
+    if (strcmp(slot->key_id, key_id))
+        return NULL;
+
+    return slot;
+}
@@ -17,7 +17,9 @@
 #define TLOG_TAG "hwkey_srv"
 
 #include <assert.h>
+#include <inttypes.h>
 #include <lk/list.h>
+#include <lk/macros.h>
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdio.h>
@@ -25,22 +27,107 @@
 #include <string.h>
 #include <uapi/err.h>
 
+#include <hwcrypto/hwkey_srv.h>
 #include <interface/hwkey/hwkey.h>
 #include <lib/tipc/tipc.h>
 #include <openssl/evp.h>
+#include <openssl/hkdf.h>
 #include <openssl/mem.h>
+#include <openssl/siphash.h>
+#include <trusty/time.h>
 #include <trusty_log.h>
 
-#include <hwcrypto/hwrng_dev.h>
 #include <hwcrypto_consts.h>
+#include "event_loop.h"
 #include "hwkey_srv_priv.h"
+#include "hwrng_srv_priv.h"
+#include "send_queue.h"
+#include "slab_pool.h"
+#include "stats.h"
 
-#define HWKEY_MAX_PAYLOAD_SIZE 2048
+/*
+ * Number of asynchronous key slot requests a channel may have outstanding.
+ * Can be overridden from the build configuration.
+ */
+#ifndef HWKEY_CHAN_MAX_PENDING
+#define HWKEY_CHAN_MAX_PENDING 4
+#endif
+
+/*
+ * Number of asynchronous key slot requests all channels together may have
+ * outstanding. Can be overridden from the build configuration.
+ */
+#ifndef HWKEY_MAX_ASYNC_REQS
+#define HWKEY_MAX_ASYNC_REQS 16
+#endif
+
+/*
+ * Number of requests a client can send on one channel before the service
+ * reads any of them. Can be overridden from the build configuration.
+ */
+#ifndef HWKEY_PORT_QUEUE_LEN
+#define HWKEY_PORT_QUEUE_LEN 4
+#endif
+
+/*
+ * Number of replies all hwkey channels together can have queued while their
+ * peers are not reading. Every slot holds the largest reply, about 2 KB, and
+ * is allocated at startup, so min_heap in manifest.json has to cover them.
+ * Can be overridden from the build configuration.
+ */
+#ifndef HWKEY_SEND_QUEUE_SLOTS
+#define HWKEY_SEND_QUEUE_SLOTS 4
+#endif
 
 struct hwkey_chan_ctx {
     struct tipc_event_handler evt_handler;
     handle_t chan;
     uuid_t uuid;
+    /* opaque handles created on this channel */
+    struct list_node opaque_handles;
+    /* asynchronous key slot requests waiting for the provider */
+    struct list_node pending;
+    unsigned int pending_cnt;
+    /* replies waiting for the peer to make room */
+    struct send_queue send_queue;
+    /* HKDF pseudorandom key of the peer for HWKEY_KDF_VERSION_2 */
+    uint8_t prk[EVP_MAX_MD_SIZE];
+    size_t prk_len;
+    /* bit n is set if the peer owns key slot n, computed on accept */
+    uint32_t slot_acl[];
+};
+
+#define SLOT_ACL_WORDS(cnt) (((cnt) + 31) / 32)
+
+static inline bool slot_acl_test(const struct hwkey_chan_ctx* ctx,
+                                 size_t slot) {
+    return ctx->slot_acl[slot / 32] & (1U << (slot % 32));
+}
+
+/**
+ * struct hwkey_async_req - key slot request waiting for an async handler
+ * @node:     link in &hwkey_chan_ctx.pending
+ * @ctx:      channel to reply on, NULL once the channel has been closed
+ * @hdr:      header of the request, used for the reply
+ * @starting: the handler has not returned yet
+ * @done:     hwkey_async_complete() has been called
+ * @status:   result passed to hwkey_async_complete()
+ * @klen:     key length passed to hwkey_async_complete()
+ * @start_ns: time the request was read, for statistics
+ * @id_len:   length of the requested key id, for statistics
+ * @kbuf:     buffer the handler puts the key into
+ */
+struct hwkey_async_req {
+    struct list_node node;
+    struct hwkey_chan_ctx* ctx;
+    struct hwkey_msg hdr;
+    int64_t start_ns;
+    size_t id_len;
+    bool starting;
+    bool done;
+    uint32_t status;
+    size_t klen;
+    uint8_t kbuf[HWKEY_ASYNC_KEY_MAX_SIZE];
 };
 
 /**
@@ -58,14 +145,32 @@ struct opaque_handle_node {
     struct hwkey_chan_ctx* owner;
     access_token_t token;
     struct list_node node;
+    struct list_node bucket_node;
+};
+
+/**
+ * struct token_buckets - hash table of opaque handles keyed by their token
+ * @heads: @mask + 1 lists of &struct opaque_handle_node.bucket_node
+ * @mask:  number of buckets - 1
+ * @key:   random SipHash key, so the bucket of a token tells an attacker
+ *         nothing about its value
+ */
+struct token_buckets {
+    struct list_node* heads;
+    uint32_t mask;
+    uint64_t key[2];
 };
 
 /*
- * Global list of currently valid opaque handles. Each client may only have a
- * single entry in this list for a given key slot, and this entry will be
- * cleaned up when the connection it was created for is closed.
+ * Currently valid opaque handles, indexed by key slot. There is at most one
+ * handle per key slot, and it is cleaned up when the connection it was created
+ * for is closed. Each connection also links its handles into
+ * &hwkey_chan_ctx.opaque_handles.
  */
-static struct list_node opaque_handles = LIST_INITIAL_VALUE(opaque_handles);
+static struct opaque_handle_node** opaque_handles;
+
+/* Handles that have been given a token, for get_opaque_key() */
+static struct token_buckets opaque_tokens;
 
 static void hwkey_port_handler(const uevent_t* ev, void* priv);
 static void hwkey_chan_handler(const uevent_t* ev, void* priv);
@@ -74,6 +179,12 @@ static struct tipc_event_handler hwkey_port_evt_handler = {
         .proc = hwkey_port_handler,
 };
 
+/* Channel contexts, sized for the access bitmap once the slots are known */
+static struct slab_pool hwkey_ctx_pool;
+static struct slab_pool opaque_node_pool;
+static struct slab_pool hwkey_reply_pool;
+static struct slab_pool hwkey_async_req_pool;
+
 static uint8_t req_data[HWKEY_MAX_PAYLOAD_SIZE + 1];
 static __attribute__((aligned(4))) uint8_t key_data[HWKEY_MAX_PAYLOAD_SIZE];
 
@@ -85,14 +196,47 @@ static bool is_opaque_handle(const struct hwkey_keyslot* key_slot) {
     return key_slot->handler == get_key_handle;
 }
 
+static size_t key_slot_index(const struct hwkey_keyslot* slot) {
+    assert(slot >= key_slots && slot < key_slots + key_slot_cnt);
+    return (size_t)(slot - key_slots);
+}
+
+static int token_buckets_init(struct token_buckets* tb, size_t cnt) {
+    uint32_t n = 1;
+
+    while (n < cnt)
+        n <<= 1;
+
+    tb->heads = calloc(n, sizeof(*tb->heads));
+    if (!tb->heads)
+        return ERR_NO_MEMORY;
+
+    for (uint32_t i = 0; i < n; i++)
+        list_initialize(&tb->heads[i]);
+    tb->mask = n - 1;
+
+    return hwrng_get_rng_data((uint8_t*)tb->key, sizeof(tb->key));
+}
+
+static struct list_node* token_bucket(const struct token_buckets* tb,
+                                      const char* token) {
+    uint64_t h = SIPHASH_24(tb->key, (const uint8_t*)token,
+                            HWKEY_OPAQUE_HANDLE_SIZE);
+    return &tb->heads[h & tb->mask];
+}
+
 static void delete_opaque_handle(struct opaque_handle_node* node) {
     assert(node);
 
+    if (list_in_list(&node->bucket_node))
+        list_delete(&node->bucket_node);
+
     /* Zero out the access token just in case the memory is reused */
     memset(node->token, 0, HWKEY_OPAQUE_HANDLE_SIZE);
 
+    opaque_handles[key_slot_index(node->key_slot)] = NULL;
     list_delete(&node->node);
-    free(node);
+    slab_pool_free(&opaque_node_pool, node);
 }
 
 /*
@@ -101,14 +245,25 @@ static void delete_opaque_handle(struct opaque_handle_node* node) {
 static void hwkey_ctx_close(struct hwkey_chan_ctx* ctx) {
     struct opaque_handle_node* entry;
     struct opaque_handle_node* temp;
-    list_for_every_entry_safe(&opaque_handles, entry, temp,
+    list_for_every_entry_safe(&ctx->opaque_handles, entry, temp,
                               struct opaque_handle_node, node) {
-        if (entry->owner == ctx) {
-            delete_opaque_handle(entry);
-        }
+        delete_opaque_handle(entry);
     }
+
+    /* the provider still owns pending requests, they are freed on completion */
+    struct hwkey_async_req* req;
+    struct hwkey_async_req* req_temp;
+    list_for_every_entry_safe(&ctx->pending, req, req_temp,
+                              struct hwkey_async_req, node) {
+        list_delete(&req->node);
+        req->ctx = NULL;
+    }
+
+    send_queue_clear(&ctx->send_queue);
+    OPENSSL_cleanse(ctx->prk, sizeof(ctx->prk));
+    hwcrypto_cancel_events(ctx->chan);
     close(ctx->chan);
-    free(ctx);
+    slab_pool_free(&hwkey_ctx_pool, ctx);
 }
 
 /*
@@ -119,8 +274,8 @@ static int hwkey_send_rsp(struct hwkey_chan_ctx* ctx,
                           uint8_t* rsp_data,
                           size_t rsp_data_len) {
     rsp_hdr->cmd |= HWKEY_RESP_BIT;
-    return tipc_send2(ctx->chan, rsp_hdr, sizeof(*rsp_hdr), rsp_data,
-                      rsp_data_len);
+    return send_queue_send2(&ctx->send_queue, ctx->chan, rsp_hdr,
+                            sizeof(*rsp_hdr), rsp_data, rsp_data_len);
 }
 
 static bool is_allowed_to_read_opaque_key(const uuid_t* uuid,
@@ -139,27 +294,22 @@ static bool is_allowed_to_read_opaque_key(const uuid_t* uuid,
 
 static struct opaque_handle_node* find_opaque_handle_for_slot(
         const struct hwkey_keyslot* slot) {
-    struct opaque_handle_node* entry;
-    list_for_every_entry(&opaque_handles, entry, struct opaque_handle_node,
-                         node) {
-        if (entry->key_slot == slot) {
-            return entry;
-        }
-    }
-
-    return NULL;
+    return opaque_handles[key_slot_index(slot)];
 }
 
 /*
  * If a handle doesn't exist yet for the given slot, create and insert a new one
- * in the global list.
+ * in the handle table and the list of the owning channel.
  */
 static uint32_t insert_handle_node(struct hwkey_chan_ctx* ctx,
                                    const struct hwkey_keyslot* slot) {
+    if (!opaque_handles)
+        return HWKEY_ERR_GENERIC;
+
     struct opaque_handle_node* entry = find_opaque_handle_for_slot(slot);
 
     if (!entry) {
-        entry = calloc(1, sizeof(struct opaque_handle_node));
+        entry = slab_pool_alloc(&opaque_node_pool);
         if (!entry) {
             TLOGE("Could not allocate new opaque_handle_node\n");
             return HWKEY_ERR_GENERIC;
@@ -167,21 +317,28 @@ static uint32_t insert_handle_node(struct hwkey_chan_ctx* ctx,
 
         entry->owner = ctx;
         entry->key_slot = slot;
-        list_add_tail(&opaque_handles, &entry->node);
+        opaque_handles[key_slot_index(slot)] = entry;
+        list_add_tail(&ctx->opaque_handles, &entry->node);
     }
 
     return HWKEY_NO_ERROR;
 }
 
-static uint32_t _handle_slots(struct hwkey_chan_ctx* ctx,
-                              const char* slot_id,
-                              const struct hwkey_keyslot* slots,
-                              unsigned int slot_cnt,
-                              uint8_t* kbuf,
-                              size_t kbuf_len,
-                              size_t* klen) {
-    if (!slots)
-        return HWKEY_ERR_NOT_FOUND;
+/*
+ * Find the key slot @slot_id of the peer of @ctx
+ */
+static const struct hwkey_keyslot* find_keyslot(
+        const struct hwkey_chan_ctx* ctx,
+        const char* slot_id,
+        const struct hwkey_keyslot* slots,
+        unsigned int slot_cnt) {
+    if (hwkey_slot_index_ready()) {
+        const struct hwkey_keyslot* slot =
+                hwkey_slot_index_find(slot_id, &ctx->uuid);
+        if (slot && slot_acl_test(ctx, key_slot_index(slot)))
+            return slot;
+        return NULL;
+    }
 
     for (unsigned int i = 0; i < slot_cnt; i++, slots++) {
         /* check key id */
@@ -189,16 +346,43 @@ static uint32_t _handle_slots(struct hwkey_chan_ctx* ctx,
             continue;
 
         /* Check if the caller is allowed to get that key */
-        if (memcmp(&ctx->uuid, slots->uuid, sizeof(uuid_t)) == 0) {
-            if (slots->handler) {
-                if (is_opaque_handle(slots)) {
-                    uint32_t rc = insert_handle_node(ctx, slots);
-                    if (rc != HWKEY_NO_ERROR)
-                        return rc;
-                }
-                return slots->handler(slots, kbuf, kbuf_len, klen);
-            }
+        if (slot_acl_test(ctx, i))
+            return slots;
+    }
+    return NULL;
+}
+
+/*
+ * Mark the key slots the peer of @ctx may use
+ */
+static void hwkey_ctx_init_acl(struct hwkey_chan_ctx* ctx) {
+    for (unsigned int i = 0; i < key_slot_cnt; i++) {
+        if (hwkey_slot_has_handler(&key_slots[i]) &&
+            memcmp(&ctx->uuid, key_slots[i].uuid, sizeof(uuid_t)) == 0)
+            ctx->slot_acl[i / 32] |= 1U << (i % 32);
+    }
+}
+
+/*
+ * Serve @slot_id, either from @slot, which find_keyslot() returned for it, or
+ * as an opaque access handle if @slot is NULL
+ */
+static uint32_t _handle_slot(struct hwkey_chan_ctx* ctx,
+                             const char* slot_id,
+                             const struct hwkey_keyslot* slot,
+                             uint8_t* kbuf,
+                             size_t kbuf_len,
+                             size_t* klen) {
+    if (slot) {
+        if (!slot->handler)
+            return HWKEY_ERR_NOT_IMPLEMENTED;
+
+        if (is_opaque_handle(slot)) {
+            uint32_t rc = insert_handle_node(ctx, slot);
+            if (rc != HWKEY_NO_ERROR)
+                return rc;
         }
+        return slot->handler(slot, kbuf, kbuf_len, klen);
     }
 
     /*
@@ -208,20 +392,35 @@ static uint32_t _handle_slots(struct hwkey_chan_ctx* ctx,
     return get_opaque_key(&ctx->uuid, slot_id, kbuf, kbuf_len, klen);
 }
 
-uint32_t hwkey_get_derived_key(const struct hwkey_derived_keyslot_data* data,
-                               uint8_t* kbuf,
-                               size_t kbuf_len,
-                               size_t* klen) {
-    assert(kbuf);
-    assert(klen);
-    assert(data);
-    assert(data->encrypted_key_size_ptr);
+static uint32_t _handle_slots(struct hwkey_chan_ctx* ctx,
+                              const char* slot_id,
+                              const struct hwkey_keyslot* slots,
+                              unsigned int slot_cnt,
+                              uint8_t* kbuf,
+                              size_t kbuf_len,
+                              size_t* klen) {
+    if (!slots)
+        return HWKEY_ERR_NOT_FOUND;
+
+    return _handle_slot(ctx, slot_id,
+                        find_keyslot(ctx, slot_id, slots, slot_cnt), kbuf,
+                        kbuf_len, klen);
+}
 
+/*
+ * Decrypt the wrapped key in @data with the key from its retriever
+ */
+static uint32_t unwrap_derived_key(
+        const struct hwkey_derived_keyslot_data* data,
+        uint8_t* kbuf,
+        size_t kbuf_len,
+        size_t* klen) {
     uint8_t key_buffer[HWKEY_DERIVED_KEY_MAX_SIZE] = {0};
     size_t key_len;
     uint32_t rc =
             data->retriever(data, key_buffer, sizeof(key_buffer), &key_len);
     if (rc != HWKEY_NO_ERROR) {
+        OPENSSL_cleanse(key_buffer, sizeof(key_buffer));
         return rc;
     }
 
@@ -235,6 +434,7 @@ uint32_t hwkey_get_derived_key(const struct hwkey_derived_keyslot_data* data,
         break;
     default:
         TLOGE("invalid key length: (%zd)\n", key_len);
+        OPENSSL_cleanse(key_buffer, sizeof(key_buffer));
         return HWKEY_ERR_GENERIC;
     }
 
@@ -243,6 +443,7 @@ uint32_t hwkey_get_derived_key(const struct hwkey_derived_keyslot_data* data,
     uint8_t* iv = NULL;
     EVP_CIPHER_CTX* cipher_ctx = EVP_CIPHER_CTX_new();
     if (!cipher_ctx) {
+        OPENSSL_cleanse(key_buffer, sizeof(key_buffer));
         return HWKEY_ERR_GENERIC;
     }
 
@@ -312,22 +513,154 @@ out:
         free(iv);
     }
     EVP_CIPHER_CTX_free(cipher_ctx);
+    OPENSSL_cleanse(key_buffer, sizeof(key_buffer));
+    return rc;
+}
+
+uint32_t hwkey_get_derived_key(const struct hwkey_derived_keyslot_data* data,
+                               uint8_t* kbuf,
+                               size_t kbuf_len,
+                               size_t* klen) {
+    assert(kbuf);
+    assert(klen);
+    assert(data);
+    assert(data->encrypted_key_size_ptr);
+
+    uint32_t rc = hwkey_derived_cache_get(data, kbuf, kbuf_len, klen);
+    if (rc != HWKEY_ERR_NOT_FOUND)
+        return rc;
+
+    rc = unwrap_derived_key(data, kbuf, kbuf_len, klen);
+    if (rc == HWKEY_NO_ERROR)
+        hwkey_derived_cache_put(data, kbuf, *klen);
+
     return rc;
 }
 
+/*
+ * Reply to a finished asynchronous request and free it
+ */
+static int hwkey_async_finish(struct hwkey_async_req* req) {
+    int rc = NO_ERROR;
+    struct hwkey_chan_ctx* ctx = req->ctx;
+
+    assert(req->done);
+
+    if (ctx) {
+        list_delete(&req->node);
+        ctx->pending_cnt--;
+
+        req->hdr.status = req->status;
+        rc = hwkey_send_rsp(ctx, &req->hdr, req->kbuf,
+                            req->status == HWKEY_NO_ERROR ? req->klen : 0);
+    }
+
+    hwcrypto_stats_record(HWCRYPTO_STATS_HWKEY_GET_KEYSLOT, req->start_ns,
+                          req->id_len,
+                          !ctx || rc < 0 || req->status != HWKEY_NO_ERROR);
+
+    OPENSSL_cleanse(req, sizeof(*req));
+    slab_pool_free(&hwkey_async_req_pool, req);
+    return rc;
+}
+
+void hwkey_async_complete(struct hwkey_async_req* req,
+                          uint32_t status,
+                          size_t klen) {
+    assert(req);
+    assert(!req->done);
+
+    req->done = true;
+    req->status = status;
+    req->klen = MIN(klen, sizeof(req->kbuf));
+
+    /* completed synchronously, hwkey_start_async_keyslot() takes care of it */
+    if (req->starting)
+        return;
+
+    struct hwkey_chan_ctx* ctx = req->ctx;
+    int rc = hwkey_async_finish(req);
+    if (rc < 0) {
+        TLOGE("failed (%d) to send async reply on chan %d\n", rc, ctx->chan);
+        hwkey_ctx_close(ctx);
+    }
+}
+
+/*
+ * Start an asynchronous key slot request, the reply is sent on completion
+ */
+static int hwkey_start_async_keyslot(struct hwkey_chan_ctx* ctx,
+                                     struct hwkey_msg* hdr,
+                                     const struct hwkey_keyslot* slot,
+                                     int64_t start_ns,
+                                     size_t id_len) {
+    struct hwkey_async_req* req = NULL;
+
+    if (ctx->pending_cnt >= HWKEY_CHAN_MAX_PENDING) {
+        TLOGE("too many pending requests on chan %d\n", ctx->chan);
+        goto err;
+    }
+
+    req = slab_pool_alloc(&hwkey_async_req_pool);
+    if (!req) {
+        TLOGE("failed to allocate async request\n");
+        goto err;
+    }
+
+    req->ctx = ctx;
+    req->hdr = *hdr;
+    req->start_ns = start_ns;
+    req->id_len = id_len;
+    req->starting = true;
+    list_add_tail(&ctx->pending, &req->node);
+    ctx->pending_cnt++;
+
+    uint32_t status =
+            slot->async_handler(slot, req, req->kbuf, sizeof(req->kbuf));
+    req->starting = false;
+    if (status != HWKEY_NO_ERROR) {
+        assert(!req->done);
+        req->done = true;
+        req->status = status;
+    }
+
+    if (req->done)
+        return hwkey_async_finish(req);
+
+    return NO_ERROR;
+
+err:
+    hdr->status = HWKEY_ERR_GENERIC;
+    hwcrypto_stats_record(HWCRYPTO_STATS_HWKEY_GET_KEYSLOT, start_ns, id_len,
+                          true);
+    return hwkey_send_rsp(ctx, hdr, NULL, 0);
+}
+
 /*
  * Handle get key slot command
  */
 static int hwkey_handle_get_keyslot_cmd(struct hwkey_chan_ctx* ctx,
                                         struct hwkey_msg* hdr,
-                                        const char* slot_id) {
+                                        const char* slot_id,
+                                        int64_t start_ns) {
     int rc;
     size_t klen = 0;
+    size_t id_len = strlen(slot_id);
+    const struct hwkey_keyslot* slot = NULL;
+
+    /* asynchronous requests are accounted for when they complete */
+    if (key_slots) {
+        slot = find_keyslot(ctx, slot_id, key_slots, key_slot_cnt);
+        if (slot && slot->async_handler)
+            return hwkey_start_async_keyslot(ctx, hdr, slot, start_ns, id_len);
+    }
 
-    hdr->status = _handle_slots(ctx, slot_id, key_slots, key_slot_cnt, key_data,
-                                sizeof(key_data), &klen);
+    hdr->status = _handle_slot(ctx, slot_id, slot, key_data, sizeof(key_data),
+                               &klen);
 
     rc = hwkey_send_rsp(ctx, hdr, key_data, klen);
+    hwcrypto_stats_record(HWCRYPTO_STATS_HWKEY_GET_KEYSLOT, start_ns, id_len,
+                          rc < 0 || hdr->status != HWKEY_NO_ERROR);
     if (klen) {
         /* sanitize key buffer */
         memset(key_data, 0, klen);
@@ -335,6 +668,104 @@ static int hwkey_handle_get_keyslot_cmd(struct hwkey_chan_ctx* ctx,
     return rc;
 }
 
+__WEAK uint32_t derive_key_v2_extract(const uuid_t* uuid,
+                                      uint8_t* prk,
+                                      size_t prk_buf_len,
+                                      size_t* prk_len) {
+    return HWKEY_ERR_NOT_IMPLEMENTED;
+}
+
+/*
+ * Derive key V2 - HKDF-SHA256 expand from the cached pseudorandom key of the
+ * peer
+ */
+static uint32_t derive_key_v2(struct hwkey_chan_ctx* ctx,
+                              const uint8_t* info,
+                              size_t info_len,
+                              size_t out_len,
+                              uint8_t* key_buf,
+                              size_t* key_len) {
+    uint32_t rc;
+    size_t key_buf_len = *key_len;
+
+    *key_len = 0;
+
+    /* zero keeps the V1 convention of deriving as many bytes as we got */
+    if (!out_len)
+        out_len = info_len;
+    if (!out_len || out_len > key_buf_len)
+        return HWKEY_ERR_BAD_LEN;
+
+    /* the extract step only depends on the peer, do it once per channel */
+    if (!ctx->prk_len) {
+        rc = derive_key_v2_extract(&ctx->uuid, ctx->prk, sizeof(ctx->prk),
+                                   &ctx->prk_len);
+        if (rc != HWKEY_NO_ERROR) {
+            OPENSSL_cleanse(ctx->prk, sizeof(ctx->prk));
+            ctx->prk_len = 0;
+            return rc;
+        }
+    }
+
+    if (!HKDF_expand(key_buf, out_len, EVP_sha256(), ctx->prk, ctx->prk_len,
+                     info, info_len)) {
+        TLOGE("HKDF expand failed\n");
+        memset(key_buf, 0, out_len);
+        return HWKEY_ERR_GENERIC;
+    }
+
+    *key_len = out_len;
+    return HWKEY_NO_ERROR;
+}
+
+/*
+ * Derive a key with the function selected by @kdf_version, which is updated to
+ * the version actually used. On entry @key_len holds the size of @key_buf.
+ */
+static uint32_t hwkey_derive_key(struct hwkey_chan_ctx* ctx,
+                                 uint32_t* kdf_version,
+                                 uint32_t out_len,
+                                 const uint8_t* ikm_data,
+                                 size_t ikm_len,
+                                 uint8_t* key_buf,
+                                 size_t* key_len) {
+    uint32_t rc;
+    size_t key_buf_len = *key_len;
+
+    /* check requested key derivation function */
+    bool best = *kdf_version == HWKEY_KDF_VERSION_BEST;
+    if (best)
+        *kdf_version = HWKEY_KDF_VERSION_2;
+
+    switch (*kdf_version) {
+    case HWKEY_KDF_VERSION_2:
+        rc = derive_key_v2(ctx, ikm_data, ikm_len, out_len, key_buf, key_len);
+        if (!best || rc != HWKEY_ERR_NOT_IMPLEMENTED)
+            break;
+
+        /* the provider has no V2, fall back to V1 */
+        *kdf_version = HWKEY_KDF_VERSION_1;
+        *key_len = key_buf_len;
+        /* fall through */
+    case HWKEY_KDF_VERSION_1:
+        /* V1 keys are as long as their input */
+        if (ikm_len > key_buf_len) {
+            *key_len = 0;
+            rc = HWKEY_ERR_BAD_LEN;
+            break;
+        }
+        rc = derive_key_v1(&ctx->uuid, ikm_data, ikm_len, key_buf, key_len);
+        break;
+
+    default:
+        TLOGE("%u is unsupported KDF function\n", *kdf_version);
+        *key_len = 0;
+        rc = HWKEY_ERR_NOT_IMPLEMENTED;
+    }
+
+    return rc;
+}
+
 /*
  * Handle Derive key cmd
  */
@@ -345,27 +776,129 @@ static int hwkey_handle_derive_key_cmd(struct hwkey_chan_ctx* ctx,
     int rc;
     size_t key_len = sizeof(key_data);
 
-    /* check requested key derivation function */
-    if (hdr->arg1 == HWKEY_KDF_VERSION_BEST)
-        hdr->arg1 = HWKEY_KDF_VERSION_1; /* we only support V1 */
+    hdr->status = hwkey_derive_key(ctx, &hdr->arg1, hdr->arg2, ikm_data,
+                                   ikm_len, key_data, &key_len);
 
-    switch (hdr->arg1) {
-    case HWKEY_KDF_VERSION_1:
-        hdr->status = derive_key_v1(&ctx->uuid, ikm_data, ikm_len, key_data,
-                                    &key_len);
+    rc = hwkey_send_rsp(ctx, hdr, key_data, key_len);
+    if (key_len) {
+        /* sanitize key buffer */
+        memset(key_data, 0, key_len);
+    }
+    return rc;
+}
+
+/*
+ * Run one sub-request of a batch, placing its result at @rsp
+ */
+static void hwkey_handle_batch_entry(struct hwkey_chan_ctx* ctx,
+                                     const struct hwkey_batch_entry* req,
+                                     const uint8_t* req_payload,
+                                     struct hwkey_batch_entry* rsp,
+                                     uint8_t* rsp_payload,
+                                     size_t rsp_payload_len) {
+    size_t klen = rsp_payload_len;
+    char short_id[HWKEY_OPAQUE_HANDLE_SIZE] = {0};
+
+    *rsp = *req;
+    rsp->cmd |= HWKEY_RESP_BIT;
+
+    switch (req->cmd) {
+    case HWKEY_GET_KEYSLOT:
+        /* key ids are used in place, so they have to come terminated */
+        if (!req->len || req_payload[req->len - 1]) {
+            klen = 0;
+            rsp->status = HWKEY_ERR_NOT_VALID;
+            break;
+        }
+
+        /* an opaque handle lookup reads a whole token worth of bytes */
+        const char* slot_id = (const char*)req_payload;
+        if (req->len < sizeof(short_id)) {
+            memcpy(short_id, req_payload, req->len);
+            slot_id = short_id;
+        }
+
+        klen = 0;
+        rsp->status = _handle_slots(ctx, slot_id, key_slots, key_slot_cnt,
+                                    rsp_payload, rsp_payload_len, &klen);
+        break;
+
+    case HWKEY_DERIVE:
+        rsp->status = hwkey_derive_key(ctx, &rsp->arg1, req->arg2, req_payload,
+                                       req->len, rsp_payload, &klen);
         break;
 
     default:
-        TLOGE("%u is unsupported KDF function\n", hdr->arg1);
-        key_len = 0;
-        hdr->status = HWKEY_ERR_NOT_IMPLEMENTED;
+        TLOGE("Unsupported batch request: %d\n", (int)req->cmd);
+        klen = 0;
+        rsp->status = HWKEY_ERR_NOT_IMPLEMENTED;
     }
 
-    rc = hwkey_send_rsp(ctx, hdr, key_data, key_len);
-    if (key_len) {
-        /* sanitize key buffer */
-        memset(key_data, 0, key_len);
+    if (rsp->status != HWKEY_NO_ERROR)
+        klen = 0;
+    rsp->len = (uint32_t)klen;
+}
+
+/*
+ * Handle batch cmd
+ *
+ * The sub-responses are built in key_data, which is as large as the largest
+ * response we can send. Sub-requests run in order until the response is full,
+ * the ones after that fail with HWKEY_ERR_BAD_LEN.
+ */
+static int hwkey_handle_batch_cmd(struct hwkey_chan_ctx* ctx,
+                                  struct hwkey_msg* hdr,
+                                  const uint8_t* req,
+                                  size_t req_len) {
+    int rc;
+    size_t req_pos = 0;
+    size_t rsp_pos = 0;
+    uint32_t cnt = hdr->arg1;
+
+    /*
+     * Every sub-request header takes as much room in the response as in the
+     * request, so if they fit in one they fit in the other. Keep room for all
+     * of them before handing out space for returned keys.
+     */
+    hdr->status = HWKEY_NO_ERROR;
+    if (!cnt || cnt > req_len / sizeof(struct hwkey_batch_entry))
+        hdr->status = HWKEY_ERR_NOT_VALID;
+
+    for (uint32_t i = 0; i < cnt && hdr->status == HWKEY_NO_ERROR; i++) {
+        struct hwkey_batch_entry entry;
+        struct hwkey_batch_entry rsp_entry;
+
+        if (req_len - req_pos < sizeof(entry)) {
+            hdr->status = HWKEY_ERR_NOT_VALID;
+            break;
+        }
+        memcpy(&entry, req + req_pos, sizeof(entry));
+        req_pos += sizeof(entry);
+        if (req_len - req_pos < entry.len) {
+            hdr->status = HWKEY_ERR_NOT_VALID;
+            break;
+        }
+
+        size_t avail = sizeof(key_data) - rsp_pos -
+                       (cnt - i) * sizeof(struct hwkey_batch_entry);
+        hwkey_handle_batch_entry(ctx, &entry, req + req_pos, &rsp_entry,
+                                 key_data + rsp_pos + sizeof(rsp_entry),
+                                 avail);
+        memcpy(key_data + rsp_pos, &rsp_entry, sizeof(rsp_entry));
+        rsp_pos += sizeof(rsp_entry) + round_up(rsp_entry.len, 4);
+
+        req_pos = MIN(req_len, req_pos + round_up(entry.len, 4));
+    }
+
+    if (hdr->status != HWKEY_NO_ERROR) {
+        TLOGE("malformed batch request\n");
+        rsp_pos = 0;
     }
+
+    rc = hwkey_send_rsp(ctx, hdr, key_data, rsp_pos);
+
+    /* failed sub-requests may have left data past their entry */
+    memset(key_data, 0, sizeof(key_data));
     return rc;
 }
 
@@ -379,11 +912,15 @@ static int hwkey_chan_handle_msg(struct hwkey_chan_ctx* ctx) {
 
     rc = tipc_recv_hdr_payload(ctx->chan, &hdr, sizeof(hdr), req_data,
                                sizeof(req_data) - 1);
-    if (rc < 0) {
+    if (rc == ERR_NO_MSG) {
+        return rc; /* all queued requests have been read */
+    } else if (rc < 0) {
         TLOGE("failed (%d) to recv msg from chan %d\n", rc, ctx->chan);
         return rc;
     }
 
+    int64_t start_ns = hwcrypto_stats_now();
+
     /* calculate payload length */
     req_data_len = (size_t)rc - sizeof(hdr);
 
@@ -391,12 +928,24 @@ static int hwkey_chan_handle_msg(struct hwkey_chan_ctx* ctx) {
     switch (hdr.cmd) {
     case HWKEY_GET_KEYSLOT:
         req_data[req_data_len] = 0; /* force zero termination */
-        rc = hwkey_handle_get_keyslot_cmd(ctx, &hdr, (const char*)req_data);
+        rc = hwkey_handle_get_keyslot_cmd(ctx, &hdr, (const char*)req_data,
+                                          start_ns);
         break;
 
     case HWKEY_DERIVE:
         rc = hwkey_handle_derive_key_cmd(ctx, &hdr, req_data, req_data_len);
         memset(req_data, 0, req_data_len); /* sanitize request buffer */
+        hwcrypto_stats_record(HWCRYPTO_STATS_HWKEY_DERIVE, start_ns,
+                              req_data_len,
+                              rc < 0 || hdr.status != HWKEY_NO_ERROR);
+        break;
+
+    case HWKEY_BATCH:
+        rc = hwkey_handle_batch_cmd(ctx, &hdr, req_data, req_data_len);
+        memset(req_data, 0, req_data_len); /* sanitize request buffer */
+        hwcrypto_stats_record(HWCRYPTO_STATS_HWKEY_BATCH, start_ns,
+                              req_data_len,
+                              rc < 0 || hdr.status != HWKEY_NO_ERROR);
         break;
 
     default:
@@ -425,9 +974,30 @@ static void hwkey_chan_handler(const uevent_t* ev, void* priv) {
         return;
     }
 
-    if (ev->event & IPC_HANDLE_POLL_MSG) {
-        int rc = hwkey_chan_handle_msg(ctx);
+    if (ev->event & IPC_HANDLE_POLL_SEND_UNBLOCKED) {
+        int rc = send_queue_flush(&ctx->send_queue, ctx->chan);
         if (rc < 0) {
+            TLOGE("failed (%d) to send queued replies on channel %d\n", rc,
+                  ev->handle);
+            hwkey_ctx_close(ctx);
+            return;
+        }
+    }
+
+    /*
+     * Keys are not handed out before the self tests have passed. Requests
+     * stay queued on the channel, which keeps reporting them until then.
+     */
+    if (!hwcrypto_self_tests_done())
+        return;
+
+    if (ev->event & IPC_HANDLE_POLL_MSG) {
+        /* read every request the client has queued up */
+        int rc;
+        do {
+            rc = hwkey_chan_handle_msg(ctx);
+        } while (rc >= 0);
+        if (rc != ERR_NO_MSG) {
             /* report an error and close channel */
             TLOGE("failed (%d) to handle event on channel %d\n", rc,
                   ev->handle);
@@ -459,9 +1029,9 @@ static void hwkey_port_handler(const uevent_t* ev, void* priv) {
             return;
         }
 
-        struct hwkey_chan_ctx* ctx = calloc(1, sizeof(*ctx));
+        struct hwkey_chan_ctx* ctx = slab_pool_alloc(&hwkey_ctx_pool);
         if (!ctx) {
-            TLOGE("failed (%d) to allocate context on chan %d\n", rc, chan);
+            TLOGE("failed to allocate context on chan %d\n", chan);
             close(chan);
             return;
         }
@@ -471,6 +1041,10 @@ static void hwkey_port_handler(const uevent_t* ev, void* priv) {
         ctx->evt_handler.proc = hwkey_chan_handler;
         ctx->chan = chan;
         ctx->uuid = peer_uuid;
+        list_initialize(&ctx->opaque_handles);
+        list_initialize(&ctx->pending);
+        send_queue_init(&ctx->send_queue, &hwkey_reply_pool);
+        hwkey_ctx_init_acl(ctx);
 
         rc = set_cookie(chan, &ctx->evt_handler);
         if (rc < 0) {
@@ -491,6 +1065,50 @@ void hwkey_install_keys(const struct hwkey_keyslot* keys, unsigned int kcnt) {
 
     key_slots = keys;
     key_slot_cnt = kcnt;
+
+    opaque_handles = calloc(kcnt, sizeof(*opaque_handles));
+    if (!opaque_handles ||
+        token_buckets_init(&opaque_tokens, kcnt) != NO_ERROR) {
+        TLOGE("failed to allocate opaque handle table\n");
+        free(opaque_handles);
+        free(opaque_tokens.heads);
+        opaque_handles = NULL;
+        opaque_tokens.heads = NULL;
+    }
+
+    int rc = hwkey_slot_index_build(keys, kcnt);
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to index key slots, using linear lookup\n", rc);
+    }
+
+    /* without the pools every connection is refused */
+    rc = slab_pool_init(&hwkey_ctx_pool, "hwkey_chan_ctx",
+                        sizeof(struct hwkey_chan_ctx) +
+                                SLOT_ACL_WORDS(kcnt) * sizeof(uint32_t),
+                        HWKEY_MAX_CHANNELS);
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to allocate hwkey channel pool\n", rc);
+    }
+
+    rc = slab_pool_init(&opaque_node_pool, "opaque_handle_node",
+                        sizeof(struct opaque_handle_node),
+                        HWKEY_MAX_OPAQUE_HANDLES);
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to allocate opaque handle pool\n", rc);
+    }
+
+    rc = send_queue_pool_init(&hwkey_reply_pool, "hwkey_reply",
+                              sizeof(struct hwkey_msg) + HWKEY_MAX_PAYLOAD_SIZE,
+                              HWKEY_SEND_QUEUE_SLOTS);
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to allocate hwkey reply pool\n", rc);
+    }
+
+    rc = slab_pool_init(&hwkey_async_req_pool, "hwkey_async_req",
+                        sizeof(struct hwkey_async_req), HWKEY_MAX_ASYNC_REQS);
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to allocate async request pool\n", rc);
+    }
 }
 
 static bool is_empty_token(const char* access_token) {
@@ -504,6 +1122,25 @@ static bool is_empty_token(const char* access_token) {
     return true;
 }
 
+/* random bytes consumed per token character */
+#define TOKEN_RANDOM_BYTES_PER_CHAR sizeof(uint32_t)
+
+/*
+ * Map random words onto the non-zero byte values 1..255 to build a
+ * NUL-terminated token. Each character is the high byte of a 32-bit random
+ * word multiplied by 255, which differs from a uniform choice by less than
+ * 2^-24 per value and takes the same time for any input, unlike rejecting
+ * zero bytes.
+ */
+static void encode_token(const uint8_t* random, access_token_t token) {
+    for (size_t i = 0; i < HWKEY_OPAQUE_HANDLE_SIZE - 1; i++) {
+        uint32_t r;
+        memcpy(&r, random + i * TOKEN_RANDOM_BYTES_PER_CHAR, sizeof(r));
+        token[i] = (char)(1 + (((uint64_t)r * 255) >> 32));
+    }
+    token[HWKEY_OPAQUE_HANDLE_SIZE - 1] = 0;
+}
+
 uint32_t get_key_handle(const struct hwkey_keyslot* slot,
                         uint8_t* kbuf,
                         size_t kbuf_len,
@@ -529,52 +1166,48 @@ uint32_t get_key_handle(const struct hwkey_keyslot* slot,
 
     /*
      * We want to generate a null-terminated opaque handle with no interior null
-     * bytes, so we generate extra randomness and only use the non-zero bytes.
+     * bytes, so the random bytes are encoded into non-zero characters.
      */
-    uint8_t random_buf[HWKEY_OPAQUE_HANDLE_SIZE + 2];
-    while (1) {
-        int rc = hwrng_dev_get_rng_data(random_buf, sizeof(random_buf));
-        if (rc != NO_ERROR) {
-            /* Don't leave an empty entry if we couldn't generate a token */
-            delete_opaque_handle(entry);
-            return rc;
-        }
-
-        size_t token_offset = 0;
-        for (size_t i = 0; i < sizeof(random_buf) &&
-                           token_offset < HWKEY_OPAQUE_HANDLE_SIZE - 1;
-             ++i) {
-            if (random_buf[i] != 0) {
-                entry->token[token_offset] = random_buf[i];
-                token_offset++;
-            }
-        }
-        if (token_offset == HWKEY_OPAQUE_HANDLE_SIZE - 1) {
-            break;
-        }
+    uint8_t random_buf[(HWKEY_OPAQUE_HANDLE_SIZE - 1) *
+                       TOKEN_RANDOM_BYTES_PER_CHAR];
+    int rc = hwrng_get_rng_data(random_buf, sizeof(random_buf));
+    if (rc != NO_ERROR) {
+        /* Don't leave an empty entry if we couldn't generate a token */
+        delete_opaque_handle(entry);
+        return rc;
     }
 
+    encode_token(random_buf, entry->token);
+    OPENSSL_cleanse(random_buf, sizeof(random_buf));
+
     /* ensure that token is properly null-terminated */
     assert(entry->token[HWKEY_OPAQUE_HANDLE_SIZE - 1] == 0);
 
+    list_add_tail(token_bucket(&opaque_tokens, entry->token),
+                  &entry->bucket_node);
+
     memcpy(kbuf, entry->token, HWKEY_OPAQUE_HANDLE_SIZE);
     *klen = HWKEY_OPAQUE_HANDLE_SIZE;
 
     return HWKEY_NO_ERROR;
 }
 
-uint32_t get_opaque_key(const uuid_t* uuid,
-                        const char* access_token,
-                        uint8_t* kbuf,
-                        size_t kbuf_len,
-                        size_t* klen) {
+/*
+ * Find the handle with @token in @tb that @uuid may read, if any. A NULL @uuid
+ * skips the access check.
+ */
+static struct opaque_handle_node* token_buckets_find(
+        const struct token_buckets* tb,
+        const uuid_t* uuid,
+        const char* token) {
     struct opaque_handle_node* entry;
-    list_for_every_entry(&opaque_handles, entry, struct opaque_handle_node,
-                         node) {
-        /* get_key_handle should never leave an empty token in the list */
+
+    list_for_every_entry(token_bucket(tb, token), entry,
+                         struct opaque_handle_node, bucket_node) {
+        /* get_key_handle should never leave an empty token in the table */
         assert(!is_empty_token(entry->token));
 
-        if (!is_allowed_to_read_opaque_key(uuid, entry->key_slot))
+        if (uuid && !is_allowed_to_read_opaque_key(uuid, entry->key_slot))
             continue;
 
         /*
@@ -583,18 +1216,97 @@ uint32_t get_opaque_key(const uuid_t* uuid,
          * allowed to retrieve this key, one of its clients may be trying to
          * brute force the token, so this comparison must be constant-time.
          */
-        if (CRYPTO_memcmp(entry->token, access_token,
-                          HWKEY_OPAQUE_HANDLE_SIZE) == 0) {
-            const struct hwkey_opaque_handle_data* handle =
-                    entry->key_slot->priv;
-            assert(handle);
-            return handle->retriever(handle, kbuf, kbuf_len, klen);
+        if (CRYPTO_memcmp(entry->token, token, HWKEY_OPAQUE_HANDLE_SIZE) ==
+            0) {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+uint32_t get_opaque_key(const uuid_t* uuid,
+                        const char* access_token,
+                        uint8_t* kbuf,
+                        size_t kbuf_len,
+                        size_t* klen) {
+    if (!opaque_tokens.heads)
+        return HWKEY_ERR_NOT_FOUND;
+
+    struct opaque_handle_node* entry =
+            token_buckets_find(&opaque_tokens, uuid, access_token);
+    if (!entry)
+        return HWKEY_ERR_NOT_FOUND;
+
+    const struct hwkey_opaque_handle_data* handle = entry->key_slot->priv;
+    assert(handle);
+    return handle->retriever(handle, kbuf, kbuf_len, klen);
+}
+
+#if WITH_HWKEY_OPAQUE_BENCHMARK
+
+#define OPAQUE_BENCH_HANDLES 4096
+
+/*
+ * Log the cost of looking up a token among OPAQUE_BENCH_HANDLES handles, both
+ * through token buckets and with the linear scan over all handles that was
+ * used before
+ */
+static void hwkey_opaque_benchmark(void) {
+    struct token_buckets tb = {0};
+    struct opaque_handle_node* nodes;
+    int64_t start = 0;
+    int64_t mid = 0;
+    int64_t end = 0;
+    size_t found = 0;
+
+    nodes = calloc(OPAQUE_BENCH_HANDLES, sizeof(*nodes));
+    if (!nodes || token_buckets_init(&tb, OPAQUE_BENCH_HANDLES) != NO_ERROR) {
+        TLOGE("failed to set up opaque handle benchmark\n");
+        goto out;
+    }
+
+    for (size_t i = 0; i < OPAQUE_BENCH_HANDLES; i++) {
+        char* token = nodes[i].token;
+        if (hwrng_get_rng_data((uint8_t*)token, HWKEY_OPAQUE_HANDLE_SIZE) !=
+            NO_ERROR)
+            goto out;
+        /* same shape as the tokens made by get_key_handle() */
+        for (size_t j = 0; j < HWKEY_OPAQUE_HANDLE_SIZE - 1; j++)
+            token[j] = token[j] ? token[j] : 1;
+        token[HWKEY_OPAQUE_HANDLE_SIZE - 1] = 0;
+        list_add_tail(token_bucket(&tb, nodes[i].token),
+                      &nodes[i].bucket_node);
+    }
+
+    trusty_gettime(0, &start);
+    for (size_t i = 0; i < OPAQUE_BENCH_HANDLES; i++)
+        found += token_buckets_find(&tb, NULL, nodes[i].token) == &nodes[i];
+    trusty_gettime(0, &mid);
+    for (size_t i = 0; i < OPAQUE_BENCH_HANDLES; i++) {
+        for (size_t j = 0; j < OPAQUE_BENCH_HANDLES; j++) {
+            if (!CRYPTO_memcmp(nodes[j].token, nodes[i].token,
+                               HWKEY_OPAQUE_HANDLE_SIZE)) {
+                found += j == i;
+                break;
+            }
         }
     }
+    trusty_gettime(0, &end);
+
+    TLOGI("opaque token lookup among %d handles: %" PRId64
+          " ns bucketed, %" PRId64 " ns linear, %zu/%d found\n",
+          OPAQUE_BENCH_HANDLES, (mid - start) / OPAQUE_BENCH_HANDLES,
+          (end - mid) / OPAQUE_BENCH_HANDLES, found,
+          2 * OPAQUE_BENCH_HANDLES);
 
-    return HWKEY_ERR_NOT_FOUND;
+out:
+    free(tb.heads);
+    free(nodes);
 }
 
+#endif /* WITH_HWKEY_OPAQUE_BENCHMARK */
+
 /*
  *  Initialize HWKEY service
  */
@@ -604,8 +1316,15 @@ int hwkey_start_service(void) {
 
     TLOGD("Start HWKEY service\n");
 
+    hwcrypto_set_event_priority(hwkey_port_handler, HWCRYPTO_EVENT_PRIO_NORMAL);
+    hwcrypto_set_event_priority(hwkey_chan_handler, HWCRYPTO_EVENT_PRIO_NORMAL);
+
+#if WITH_HWKEY_OPAQUE_BENCHMARK
+    hwkey_opaque_benchmark();
+#endif
+
     /* Initialize service */
-    rc = port_create(HWKEY_PORT, 1,
+    rc = port_create(HWKEY_PORT, HWKEY_PORT_QUEUE_LEN,
                      sizeof(struct hwkey_msg) + HWKEY_MAX_PAYLOAD_SIZE,
                      IPC_PORT_ALLOW_TA_CONNECT);
     if (rc < 0) {
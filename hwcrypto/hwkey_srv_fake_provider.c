@@ -30,6 +30,7 @@
 #include <openssl/digest.h>
 #include <openssl/err.h>
 #include <openssl/hkdf.h>
+#include <openssl/mem.h>
 
 #include <interface/hwaes/hwaes.h>
 #include <interface/hwkey/hwkey.h>
@@ -38,6 +39,7 @@
 #include <trusty_log.h>
 
 #include <hwcrypto_consts.h>
+#include "event_loop.h"
 #include "hwkey_srv_priv.h"
 
 #pragma message "Compiling FAKE HWKEY provider"
@@ -125,6 +127,26 @@ uint32_t derive_key_v1(const uuid_t* uuid,
     return HWKEY_NO_ERROR;
 }
 
+/*
+ * Derive key V2 - extract step of the same HKDF as V1
+ */
+uint32_t derive_key_v2_extract(const uuid_t* uuid,
+                               uint8_t* prk,
+                               size_t prk_buf_len,
+                               size_t* prk_len) {
+    assert(prk_buf_len >= EVP_MAX_MD_SIZE);
+
+    if (!HKDF_extract(prk, prk_len, EVP_sha256(),
+                      (const uint8_t*)fake_device_key, sizeof(fake_device_key),
+                      (const uint8_t*)uuid, sizeof(uuid_t))) {
+        TLOGE("HKDF extract failed 0x%x\n", ERR_get_error());
+        *prk_len = 0;
+        return HWKEY_ERR_GENERIC;
+    }
+
+    return HWKEY_NO_ERROR;
+}
+
 /* UUID of HWCRYPTO_UNITTEST application */
 static const uuid_t hwcrypto_unittest_uuid = HWCRYPTO_UNITTEST_APP_UUID;
 
@@ -156,6 +178,22 @@ static uint32_t get_unittest_key32_handler(const struct hwkey_keyslot* slot,
     return get_unittest_key32(kbuf, kbuf_len, klen);
 }
 
+/*
+ * There is no slow hardware behind the fake provider, so the asynchronous
+ * unittest slot completes before returning
+ */
+static uint32_t get_unittest_key32_async_handler(
+        const struct hwkey_keyslot* slot,
+        struct hwkey_async_req* req,
+        uint8_t* kbuf,
+        size_t kbuf_len) {
+    size_t klen = 0;
+    uint32_t rc = get_unittest_key32(kbuf, kbuf_len, &klen);
+    if (rc == HWKEY_NO_ERROR)
+        hwkey_async_complete(req, rc, klen);
+    return rc;
+}
+
 /*
  * "unittestderivedkeyslotunittestde" encrypted with _unittest_key32 using an
  * all 0 IV. IV is prepended to the ciphertext.
@@ -245,6 +283,63 @@ static struct hwkey_opaque_handle_data unittest_opaque_derived_data = {
 
 #endif /* WITH_HWCRYPTO_UNITTEST */
 
+/*
+ * Slot keys that only depend on the device key and constants, so they are the
+ * same for the whole boot. They are computed once, by
+ * hwkey_init_srv_provider() or on first use if that failed, and kept in
+ * static storage that is wiped if computing them fails.
+ */
+#define BOOT_KEY_MAX_SIZE 32
+
+/**
+ * struct boot_key - slot key computed once per boot
+ * @compute: function computing the key into its buffer
+ * @ready:   @key holds the computed key
+ * @len:     length of @key
+ * @key:     the key
+ */
+struct boot_key {
+    uint32_t (*compute)(uint8_t* key, size_t key_buf_len, size_t* key_len);
+    bool ready;
+    size_t len;
+    uint8_t key[BOOT_KEY_MAX_SIZE];
+};
+
+static uint32_t boot_key_compute(struct boot_key* bk) {
+    uint32_t rc = bk->compute(bk->key, sizeof(bk->key), &bk->len);
+    if (rc != HWKEY_NO_ERROR) {
+        OPENSSL_cleanse(bk->key, sizeof(bk->key));
+        bk->len = 0;
+        return rc;
+    }
+
+    bk->ready = true;
+    return HWKEY_NO_ERROR;
+}
+
+static uint32_t get_boot_key(struct boot_key* bk,
+                             uint8_t* kbuf,
+                             size_t kbuf_len,
+                             size_t* klen) {
+    assert(kbuf);
+    assert(klen);
+
+    if (!bk->ready) {
+        uint32_t rc = boot_key_compute(bk);
+        if (rc != HWKEY_NO_ERROR)
+            return rc;
+    }
+
+    if (kbuf_len < bk->len) {
+        TLOGE("buffer too small: (%zd vs. %zd )\n", kbuf_len, bk->len);
+        return HWKEY_ERR_BAD_LEN;
+    }
+
+    memcpy(kbuf, bk->key, bk->len);
+    *klen = bk->len;
+    return HWKEY_NO_ERROR;
+}
+
 /*
  *  RPMB Key support
  */
@@ -262,10 +357,9 @@ static uint8_t rpmb_salt[RPMB_SS_AUTH_KEY_SIZE] = {
 /*
  * Generate RPMB Secure Storage Authentication key
  */
-static uint32_t get_rpmb_ss_auth_key(const struct hwkey_keyslot* slot,
-                                     uint8_t* kbuf,
-                                     size_t kbuf_len,
-                                     size_t* klen) {
+static uint32_t compute_rpmb_ss_auth_key(uint8_t* kbuf,
+                                         size_t kbuf_len,
+                                         size_t* klen) {
     int rc;
     int out_len;
     EVP_CIPHER_CTX evp;
@@ -273,6 +367,12 @@ static uint32_t get_rpmb_ss_auth_key(const struct hwkey_keyslot* slot,
     assert(kbuf);
     assert(klen);
 
+    if (kbuf_len < RPMB_SS_AUTH_KEY_SIZE) {
+        TLOGE("buffer too small: (%zd vs. %d )\n", kbuf_len,
+              RPMB_SS_AUTH_KEY_SIZE);
+        return HWKEY_ERR_BAD_LEN;
+    }
+
     EVP_CIPHER_CTX_init(&evp);
 
     rc = EVP_EncryptInit_ex(&evp, EVP_aes_256_cbc(), NULL, fake_device_key,
@@ -284,13 +384,6 @@ static uint32_t get_rpmb_ss_auth_key(const struct hwkey_keyslot* slot,
     if (!rc)
         goto evp_err;
 
-    size_t min_kbuf_len =
-            RPMB_SS_AUTH_KEY_SIZE + EVP_CIPHER_CTX_key_length(&evp);
-    if (kbuf_len < min_kbuf_len) {
-        TLOGE("buffer too small: (%zd vs. %zd )\n", kbuf_len, min_kbuf_len);
-        goto other_err;
-    }
-
     rc = EVP_EncryptUpdate(&evp, kbuf, &out_len, rpmb_salt, sizeof(rpmb_salt));
     if (!rc)
         goto evp_err;
@@ -317,6 +410,17 @@ other_err:
     return HWKEY_ERR_GENERIC;
 }
 
+static struct boot_key rpmb_ss_auth_key = {
+        .compute = compute_rpmb_ss_auth_key,
+};
+
+static uint32_t get_rpmb_ss_auth_key(const struct hwkey_keyslot* slot,
+                                     uint8_t* kbuf,
+                                     size_t kbuf_len,
+                                     size_t* klen) {
+    return get_boot_key(&rpmb_ss_auth_key, kbuf, kbuf_len, klen);
+}
+
 /*
  * Keymint KAK support
  */
@@ -337,10 +441,9 @@ static uint8_t kak_salt[KM_KAK_SIZE] = {
  * This should be replaced with a device-specific implementation such that
  * any Strongbox on the device will have the same KAK.
  */
-static uint32_t get_km_kak_key(const struct hwkey_keyslot* slot,
-                               uint8_t* kbuf,
-                               size_t kbuf_len,
-                               size_t* klen) {
+static uint32_t compute_km_kak_key(uint8_t* kbuf,
+                                   size_t kbuf_len,
+                                   size_t* klen) {
     assert(kbuf);
     assert(klen);
 
@@ -348,9 +451,25 @@ static uint32_t get_km_kak_key(const struct hwkey_keyslot* slot,
         return HWKEY_ERR_BAD_LEN;
     }
 
-    return derive_key_v1(slot->uuid, kak_salt, KM_KAK_SIZE, kbuf, klen);
+    return derive_key_v1(&km_uuid, kak_salt, KM_KAK_SIZE, kbuf, klen);
+}
+
+static struct boot_key km_kak_key = {
+        .compute = compute_km_kak_key,
+};
+
+static uint32_t get_km_kak_key(const struct hwkey_keyslot* slot,
+                               uint8_t* kbuf,
+                               size_t kbuf_len,
+                               size_t* klen) {
+    return get_boot_key(&km_kak_key, kbuf, kbuf_len, klen);
 }
 
+static struct boot_key* const boot_keys[] = {
+        &rpmb_ss_auth_key,
+        &km_kak_key,
+};
+
 static const uuid_t hwaes_uuid = SAMPLE_HWAES_APP_UUID;
 
 #if WITH_HWCRYPTO_UNITTEST
@@ -556,14 +675,25 @@ static const uuid_t* allowed_clients[] = {
         &hwbcc_unittest_uuid,
 };
 
+static int uuid_ptr_cmp(const void* a, const void* b) {
+    const uuid_t* const* ua = a;
+    const uuid_t* const* ub = b;
+    return memcmp(*ua, *ub, sizeof(uuid_t));
+}
+
+/*
+ * allowed_clients[] is sorted by hwkey_init_srv_provider() before the service
+ * starts, so that it can be binary searched
+ */
+static void sort_allowed_clients(void) {
+    qsort(allowed_clients, countof(allowed_clients), sizeof(allowed_clients[0]),
+          uuid_ptr_cmp);
+}
+
 bool hwkey_client_allowed(const uuid_t* uuid) {
     assert(uuid);
-    for (unsigned int i = 0; i < countof(allowed_clients); i++) {
-        if (memcmp(allowed_clients[i], uuid, sizeof(uuid_t)) == 0) {
-            return true;
-        }
-    }
-    return false;
+    return bsearch(&uuid, allowed_clients, countof(allowed_clients),
+                   sizeof(allowed_clients[0]), uuid_ptr_cmp) != NULL;
 }
 
 /*
@@ -619,6 +749,11 @@ static const struct hwkey_keyslot _keys[] = {
                 .key_id = "com.android.trusty.hwcrypto.unittest.key32",
                 .handler = get_unittest_key32_handler,
         },
+        {
+                .uuid = &hwcrypto_unittest_uuid,
+                .key_id = "com.android.trusty.hwcrypto.unittest.async_key32",
+                .async_handler = get_unittest_key32_async_handler,
+        },
         {
                 .uuid = &hwcrypto_unittest_uuid,
                 .key_id = "com.android.trusty.hwcrypto.unittest.derived_key32",
@@ -672,6 +807,11 @@ static bool hwkey_self_test(void) {
     return true;
 }
 
+static struct hwcrypto_self_test hwkey_kat = {
+        .name = "hwkey",
+        .run = hwkey_self_test,
+};
+
 /*
  *  Initialize Fake HWKEY service provider
  */
@@ -681,18 +821,28 @@ void hwkey_init_srv_provider(void) {
     TLOGE("Init FAKE!!!! HWKEY service provider\n");
     TLOGE("FAKE HWKEY service provider MUST be replaced with the REAL one\n");
 
-    /* run self test */
-    if (!hwkey_self_test()) {
-        TLOGE("hwkey_self_test failed\n");
-        abort();
-    }
+    sort_allowed_clients();
 
     /* install key handlers */
     hwkey_install_keys(_keys, countof(_keys));
 
-    /* start service */
+    /*
+     * Clients blocked in hwkey_open() can connect right away. The self test
+     * runs from the event loop and key requests wait until it has passed.
+     */
     rc = hwkey_start_service();
     if (rc != NO_ERROR) {
         TLOGE("failed (%d) to start HWKEY service\n", rc);
     }
+    hwcrypto_queue_self_test(&hwkey_kat);
+
+    /*
+     * Keys that cannot change until the next boot are computed up front.
+     * None of them is released before the self test has passed.
+     */
+    for (unsigned int i = 0; i < countof(boot_keys); i++) {
+        if (boot_key_compute(boot_keys[i]) != HWKEY_NO_ERROR) {
+            TLOGE("failed to precompute boot key %u, retrying on use\n", i);
+        }
+    }
 }
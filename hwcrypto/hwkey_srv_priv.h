@@ -21,6 +21,29 @@
 #include <sys/types.h>
 #include <uapi/trusty_uuid.h>
 
+struct hwkey_async_req;
+
+/**
+ * struct hwkey_keyslot - key slot served by the hwkey service
+ * @key_id:        key id clients request the slot by
+ * @uuid:          UUID of the only client that may use the slot
+ * @priv:          slot-specific data
+ * @handler:       returns the key of the slot
+ * @async_handler: optional, starts retrieving the key of the slot and
+ *                 completes with hwkey_async_complete(). Used instead of
+ *                 @handler for single %HWKEY_GET_KEYSLOT requests, so slots
+ *                 backed by slow hardware do not stall the service. Slots
+ *                 that only have an @async_handler cannot be part of a
+ *                 %HWKEY_BATCH request.
+ *
+ * @async_handler has to fill @kbuf, which stays valid until the request is
+ * completed, and return %HWKEY_NO_ERROR once the request is started. If it
+ * returns an error, the request has not been started and must not be
+ * completed. hwkey_async_complete() is called exactly once from the hwcrypto
+ * event loop: from the &struct tipc_event_handler the provider attached to its
+ * own waitable handle, or before @async_handler returns if the key is
+ * available right away.
+ */
 struct hwkey_keyslot {
     const char* key_id;
     const uuid_t* uuid;
@@ -29,8 +52,19 @@ struct hwkey_keyslot {
                         uint8_t* kbuf,
                         size_t kbuf_len,
                         size_t* klen);
+    uint32_t (*async_handler)(const struct hwkey_keyslot* slot,
+                              struct hwkey_async_req* req,
+                              uint8_t* kbuf,
+                              size_t kbuf_len);
 };
 
+/* Largest key an &struct hwkey_keyslot.async_handler can return */
+#define HWKEY_ASYNC_KEY_MAX_SIZE 128
+
+static inline bool hwkey_slot_has_handler(const struct hwkey_keyslot* slot) {
+    return slot->handler || slot->async_handler;
+}
+
 /**
  * struct hwkey_derived_keyslot_data - data for a keyslot which derives its key
  * by decrypting a fixed key
@@ -113,6 +147,35 @@ uint32_t hwkey_get_derived_key(const struct hwkey_derived_keyslot_data* data,
                                size_t kbuf_len,
                                size_t* klen);
 
+/**
+ * hwkey_derived_cache_get() - look up a key unwrapped by hwkey_get_derived_key()
+ *
+ * Return: HWKEY_NO_ERROR with the key copied to @kbuf, HWKEY_ERR_NOT_FOUND if
+ * the key for @data is not cached, or HWKEY_ERR_BAD_LEN if @kbuf is too small.
+ */
+uint32_t hwkey_derived_cache_get(const struct hwkey_derived_keyslot_data* data,
+                                 uint8_t* kbuf,
+                                 size_t kbuf_len,
+                                 size_t* klen);
+
+/**
+ * hwkey_derived_cache_put() - remember the unwrapped key for @data
+ *
+ * Replaces the least recently used entry if the cache is full. The replaced
+ * key is zeroed.
+ */
+void hwkey_derived_cache_put(const struct hwkey_derived_keyslot_data* data,
+                             const uint8_t* key,
+                             size_t len);
+
+/**
+ * hwkey_derived_cache_expire() - zero and drop keys that have been cached for
+ * longer than %HWKEY_DERIVED_CACHE_TTL_MS
+ *
+ * Return: time in milliseconds until the next key expires, or INFINITE_TIME.
+ */
+uint32_t hwkey_derived_cache_expire(void);
+
 /**
  * get_key_handle() - Handler for opaque keys
  *
@@ -136,12 +199,61 @@ uint32_t get_opaque_key(const uuid_t* uuid,
                         size_t kbuf_len,
                         size_t* klen);
 
+/**
+ * hwkey_async_complete() - complete a request started by an
+ * &struct hwkey_keyslot.async_handler
+ * @req:    the request passed to the handler
+ * @status: &enum hwkey_err result of the request
+ * @klen:   number of key bytes written to the buffer of the request
+ *
+ * Sends the reply if the client is still connected. @req and its buffer must
+ * not be used after this call.
+ */
+void hwkey_async_complete(struct hwkey_async_req* req,
+                          uint32_t status,
+                          size_t klen);
+
 void hwkey_init_srv_provider(void);
 
 void hwkey_install_keys(const struct hwkey_keyslot* keys, unsigned int kcnt);
 
+/**
+ * hwkey_slot_index_build() - build the perfect hash index over key slots
+ * @slots: installed key slots, must stay valid while the index is used
+ * @cnt:   number of entries in @slots
+ *
+ * Slots without a handler are left out, and so are slots with the same key id
+ * and UUID as an earlier one.
+ *
+ * Return: NO_ERROR on success, a negative error code otherwise. Lookups have
+ * to fall back to scanning @slots if the index could not be built.
+ */
+int hwkey_slot_index_build(const struct hwkey_keyslot* slots,
+                           unsigned int cnt);
+
+bool hwkey_slot_index_ready(void);
+
+/**
+ * hwkey_slot_index_find() - look up a key slot
+ * @key_id: key id requested by the client
+ * @uuid:   UUID of the client
+ *
+ * Only the key id of the slot found is compared, the caller has to check that
+ * the slot belongs to @uuid.
+ *
+ * Return: the only key slot with @key_id that can belong to @uuid, or NULL.
+ */
+const struct hwkey_keyslot* hwkey_slot_index_find(const char* key_id,
+                                                  const uuid_t* uuid);
+
 int hwkey_start_service(void);
 
+/**
+ * hwkey_client_allowed() - check if a client may connect to the service
+ * @uuid: UUID of the client
+ *
+ * Only called when a connection is accepted.
+ */
 bool hwkey_client_allowed(const uuid_t* uuid);
 
 uint32_t derive_key_v1(const uuid_t* uuid,
@@ -150,4 +262,20 @@ uint32_t derive_key_v1(const uuid_t* uuid,
                        uint8_t* key_data,
                        size_t* key_len);
 
+/**
+ * derive_key_v2_extract() - HKDF-SHA256 extract step of %HWKEY_KDF_VERSION_2
+ * @uuid:        UUID of the client the key is derived for, used as salt
+ * @prk:         buffer for the pseudorandom key
+ * @prk_buf_len: size of @prk, at least %EVP_MAX_MD_SIZE
+ * @prk_len:     set to the length of the pseudorandom key
+ *
+ * Optional. The service caches the result per channel and runs the expand step
+ * itself. Providers that do not implement it only support
+ * %HWKEY_KDF_VERSION_1.
+ */
+uint32_t derive_key_v2_extract(const uuid_t* uuid,
+                               uint8_t* prk,
+                               size_t prk_buf_len,
+                               size_t* prk_len);
+
 __END_CDECLS
@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <lk/compiler.h>
+#include <trusty_ipc.h>
+#include <uapi/err.h>
+
+#include <hwcrypto/hwrng_dev.h>
+
+/*
+ * Default asynchronous HWRNG interface for providers that only implement the
+ * blocking hwrng_dev_get_rng_data(): every request completes before
+ * hwrng_dev_start_rng_data() returns.
+ */
+
+__WEAK int hwrng_dev_start_rng_data(uint8_t* buf,
+                                    size_t buf_len,
+                                    hwrng_dev_done_t done,
+                                    void* priv) {
+    done(hwrng_dev_get_rng_data(buf, buf_len), priv);
+    return NO_ERROR;
+}
+
+__WEAK uint32_t hwrng_dev_poll(void) {
+    return INFINITE_TIME;
+}
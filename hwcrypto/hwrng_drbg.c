@@ -0,0 +1,124 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "hwrng_drbg"
+
+#include <assert.h>
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include <openssl/ctrdrbg.h>
+#include <openssl/err.h>
+#include <openssl/mem.h>
+
+#include <trusty_log.h>
+
+#include "hwrng_srv_priv.h"
+
+/*
+ * Number of bytes generated between two reseeds from the HWRNG device. This
+ * is far below the SP 800-90A limit for CTR_DRBG and keeps the amount of
+ * output depending on a single seed small. Can be overridden from the build
+ * configuration.
+ */
+#ifndef HWRNG_DRBG_RESEED_INTERVAL
+#define HWRNG_DRBG_RESEED_INTERVAL (1024 * 1024)
+#endif
+
+static const uint8_t drbg_personalization[] = "trusty.hwcrypto.hwrng.drbg";
+
+static CTR_DRBG_STATE* drbg;
+static size_t drbg_bytes_since_reseed;
+static uint64_t drbg_bytes;
+static uint64_t drbg_reseeds;
+
+/*
+ * Fetch a full CTR_DRBG seed from the HWRNG device and (re)seed the DRBG
+ */
+static int hwrng_drbg_seed(void) {
+    int rc;
+    uint8_t entropy[CTR_DRBG_ENTROPY_LEN];
+
+    /* reservoir data has already passed the health tests */
+    rc = hwrng_get_rng_data(entropy, sizeof(entropy));
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to get DRBG seed\n", rc);
+        goto out;
+    }
+
+    if (!drbg) {
+        drbg = CTR_DRBG_new(entropy, drbg_personalization,
+                            sizeof(drbg_personalization));
+        if (!drbg) {
+            TLOGE("failed to instantiate DRBG 0x%x\n", ERR_get_error());
+            rc = ERR_NO_MEMORY;
+            goto out;
+        }
+    } else if (!CTR_DRBG_reseed(drbg, entropy, NULL, 0)) {
+        TLOGE("failed to reseed DRBG 0x%x\n", ERR_get_error());
+        rc = ERR_GENERIC;
+        goto out;
+    }
+
+    drbg_bytes_since_reseed = 0;
+    drbg_reseeds++;
+    rc = NO_ERROR;
+
+out:
+    OPENSSL_cleanse(entropy, sizeof(entropy));
+    return rc;
+}
+
+int hwrng_drbg_generate(uint8_t* buf, size_t buf_len) {
+    int rc;
+
+    assert(buf || !buf_len);
+
+    while (buf_len) {
+        if (!drbg ||
+            drbg_bytes_since_reseed >= HWRNG_DRBG_RESEED_INTERVAL) {
+            rc = hwrng_drbg_seed();
+            if (rc != NO_ERROR)
+                return rc;
+        }
+
+        size_t len = MIN(buf_len, (size_t)CTR_DRBG_MAX_GENERATE_LENGTH);
+        len = MIN(len, HWRNG_DRBG_RESEED_INTERVAL - drbg_bytes_since_reseed);
+
+        if (!CTR_DRBG_generate(drbg, buf, len, NULL, 0)) {
+            TLOGE("DRBG generate failed 0x%x\n", ERR_get_error());
+            return ERR_GENERIC;
+        }
+
+        drbg_bytes_since_reseed += len;
+        drbg_bytes += len;
+        buf += len;
+        buf_len -= len;
+    }
+
+    return NO_ERROR;
+}
+
+void hwrng_drbg_get_stats(uint64_t* bytes, uint64_t* reseeds) {
+    assert(bytes);
+    assert(reseeds);
+
+    *bytes = drbg_bytes;
+    *reseeds = drbg_reseeds;
+}
@@ -0,0 +1,313 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "hwrng_health"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <lk/compiler.h>
+#include <lk/macros.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include <trusty/time.h>
+#include <trusty_log.h>
+
+#include "hwrng_srv_priv.h"
+
+/*
+ * Continuous health tests from NIST SP 800-90B section 4.4 on the raw output
+ * of the HWRNG device. Every byte is one sample.
+ *
+ * Both tests are evaluated eight samples at a time on 64-bit words: the
+ * repetition count test only drops to a per-byte loop for words that contain
+ * two equal neighbouring samples, and the adaptive proportion test counts the
+ * matching bytes of a whole word with a single multiply.
+ */
+
+#if __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "word-parallel health tests assume a little-endian target"
+#endif
+
+/*
+ * Claimed min-entropy of the noise source in bits per byte. It determines the
+ * cutoff values of both tests for a false positive probability of 2^-20 per
+ * sample. Can be overridden from the build configuration.
+ */
+#ifndef HWRNG_HEALTH_ENTROPY_BITS
+#define HWRNG_HEALTH_ENTROPY_BITS 4
+#endif
+
+/* cutoffs from SP 800-90B section 4.4.1 and table 2 */
+#if HWRNG_HEALTH_ENTROPY_BITS == 1
+#define HWRNG_RCT_CUTOFF 21
+#define HWRNG_APT_CUTOFF 311
+#elif HWRNG_HEALTH_ENTROPY_BITS == 2
+#define HWRNG_RCT_CUTOFF 11
+#define HWRNG_APT_CUTOFF 177
+#elif HWRNG_HEALTH_ENTROPY_BITS == 4
+#define HWRNG_RCT_CUTOFF 6
+#define HWRNG_APT_CUTOFF 62
+#elif HWRNG_HEALTH_ENTROPY_BITS == 8
+#define HWRNG_RCT_CUTOFF 4
+#define HWRNG_APT_CUTOFF 13
+#else
+#error "HWRNG_HEALTH_ENTROPY_BITS must be one of 1, 2, 4 or 8"
+#endif
+
+#define HWRNG_APT_WINDOW 512
+
+#define BYTES_LO 0x0101010101010101ULL
+#define BYTES_HI 0x8080808080808080ULL
+#define BYTES_LO7 0x7f7f7f7f7f7f7f7fULL
+
+/**
+ * struct hwrng_health_state - state of the continuous health tests
+ * @rct_sample: sample the current run consists of
+ * @rct_run:    length of the current run, 0 before the first sample
+ * @apt_sample: first sample of the current window
+ * @apt_count:  number of occurrences of @apt_sample in the current window
+ * @apt_pos:    number of samples seen in the current window, 0 if a new window
+ *              starts with the next sample
+ */
+struct hwrng_health_state {
+    uint8_t rct_sample;
+    uint32_t rct_run;
+    uint8_t apt_sample;
+    uint32_t apt_count;
+    uint32_t apt_pos;
+};
+
+static struct hwrng_health_state state;
+
+static struct {
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t rct_failures;
+    uint64_t apt_failures;
+} health_stats;
+
+/*
+ * Return a word with the top bit of every zero byte of @x set
+ */
+static inline uint64_t zero_bytes(uint64_t x) {
+    return ~(((x & BYTES_LO7) + BYTES_LO7) | x) & BYTES_HI;
+}
+
+/*
+ * Feed one sample to the repetition count test
+ */
+static inline int rct_sample(struct hwrng_health_state* s, uint8_t b) {
+    if (s->rct_run && b == s->rct_sample) {
+        if (++s->rct_run >= HWRNG_RCT_CUTOFF)
+            return ERR_IO;
+    } else {
+        s->rct_sample = b;
+        s->rct_run = 1;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Feed one sample to the adaptive proportion test
+ */
+static inline int apt_sample(struct hwrng_health_state* s, uint8_t b) {
+    if (!s->apt_pos) {
+        s->apt_sample = b;
+        s->apt_count = 1;
+        s->apt_pos = 1;
+        return NO_ERROR;
+    }
+
+    if (b == s->apt_sample && ++s->apt_count >= HWRNG_APT_CUTOFF)
+        return ERR_IO;
+
+    if (++s->apt_pos == HWRNG_APT_WINDOW)
+        s->apt_pos = 0;
+    return NO_ERROR;
+}
+
+/*
+ * Run both tests over @len samples, a word at a time where possible
+ *
+ * Return: NO_ERROR, or ERR_IO with @rct_failed telling which test tripped.
+ */
+static int hwrng_health_run(struct hwrng_health_state* s,
+                            const uint8_t* buf,
+                            size_t len,
+                            bool* rct_failed) {
+    size_t i = 0;
+
+    while (i < len) {
+        if (len - i >= 8 && s->rct_run && s->apt_pos &&
+            HWRNG_APT_WINDOW - s->apt_pos >= 8) {
+            uint64_t w;
+            memcpy(&w, buf + i, sizeof(w));
+
+            /* byte n of @rep is zero iff sample n equals sample n - 1 */
+            uint64_t rep = w ^ ((w << 8) | s->rct_sample);
+            if (!zero_bytes(rep)) {
+                s->rct_sample = (uint8_t)(w >> 56);
+                s->rct_run = 1;
+            } else {
+                for (size_t n = 0; n < 8; n++) {
+                    if (rct_sample(s, buf[i + n])) {
+                        *rct_failed = true;
+                        return ERR_IO;
+                    }
+                }
+            }
+
+            /* add up the matching bytes with a multiply instead of a loop */
+            uint64_t match = zero_bytes(w ^ (s->apt_sample * BYTES_LO)) >> 7;
+            s->apt_count += (match * BYTES_LO) >> 56;
+            if (s->apt_count >= HWRNG_APT_CUTOFF) {
+                *rct_failed = false;
+                return ERR_IO;
+            }
+            s->apt_pos += 8;
+            if (s->apt_pos == HWRNG_APT_WINDOW)
+                s->apt_pos = 0;
+
+            i += 8;
+            continue;
+        }
+
+        if (rct_sample(s, buf[i])) {
+            *rct_failed = true;
+            return ERR_IO;
+        }
+        if (apt_sample(s, buf[i])) {
+            *rct_failed = false;
+            return ERR_IO;
+        }
+        i++;
+    }
+
+    return NO_ERROR;
+}
+
+int hwrng_health_test(const uint8_t* buf, size_t len) {
+    int rc;
+    bool rct_failed;
+    int64_t start = 0;
+    int64_t end = 0;
+
+    assert(buf || !len);
+
+    trusty_gettime(0, &start);
+    rc = hwrng_health_run(&state, buf, len, &rct_failed);
+    trusty_gettime(0, &end);
+
+    health_stats.bytes += len;
+    health_stats.ns += (uint64_t)(end - start);
+
+    if (rc != NO_ERROR) {
+        if (rct_failed) {
+            TLOGE("repetition count test failed\n");
+            health_stats.rct_failures++;
+        } else {
+            TLOGE("adaptive proportion test failed\n");
+            health_stats.apt_failures++;
+        }
+        /* start over, none of the samples seen so far are used */
+        memset(&state, 0, sizeof(state));
+    }
+
+    return rc;
+}
+
+void hwrng_health_get_stats(struct hwrng_srv_stats* stats) {
+    assert(stats);
+
+    stats->health_bytes = health_stats.bytes;
+    stats->health_ns = health_stats.ns;
+    stats->health_rct_failures = health_stats.rct_failures;
+    stats->health_apt_failures = health_stats.apt_failures;
+}
+
+#if WITH_HWRNG_HEALTH_BENCHMARK
+
+#define HWRNG_HEALTH_BENCH_SIZE 4096
+#define HWRNG_HEALTH_BENCH_ROUNDS 256
+
+/*
+ * Byte-at-a-time reference implementation used to check and time the
+ * word-parallel version
+ */
+static int hwrng_health_run_ref(struct hwrng_health_state* s,
+                                const uint8_t* buf,
+                                size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (rct_sample(s, buf[i]) || apt_sample(s, buf[i]))
+            return ERR_IO;
+    }
+    return NO_ERROR;
+}
+
+/*
+ * Time @rounds passes over @buf, return the cost in picoseconds per byte
+ */
+static uint64_t hwrng_health_time(const uint8_t* buf, bool ref, int* rc) {
+    struct hwrng_health_state s = {0};
+    bool rct_failed;
+    int64_t start = 0;
+    int64_t end = 0;
+
+    *rc = NO_ERROR;
+    trusty_gettime(0, &start);
+    for (size_t n = 0; n < HWRNG_HEALTH_BENCH_ROUNDS && !*rc; n++) {
+        if (ref)
+            *rc = hwrng_health_run_ref(&s, buf, HWRNG_HEALTH_BENCH_SIZE);
+        else
+            *rc = hwrng_health_run(&s, buf, HWRNG_HEALTH_BENCH_SIZE,
+                                   &rct_failed);
+    }
+    trusty_gettime(0, &end);
+
+    return (uint64_t)(end - start) * 1000 /
+           (HWRNG_HEALTH_BENCH_SIZE * HWRNG_HEALTH_BENCH_ROUNDS);
+}
+
+void hwrng_health_benchmark(void) {
+    int rc;
+    int ref_rc;
+    static uint8_t buf[HWRNG_HEALTH_BENCH_SIZE];
+
+    rc = hwrng_get_rng_data(buf, sizeof(buf));
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to get benchmark data\n", rc);
+        return;
+    }
+
+    uint64_t ps = hwrng_health_time(buf, false, &rc);
+    uint64_t ref_ps = hwrng_health_time(buf, true, &ref_rc);
+
+    if (rc != ref_rc) {
+        TLOGE("word-parallel (%d) and reference (%d) results differ\n", rc,
+              ref_rc);
+    }
+
+    TLOGI("health tests: %" PRIu64 " ps/byte (byte-wise %" PRIu64
+          " ps/byte) over %d bytes, rc %d\n",
+          ps, ref_ps, HWRNG_HEALTH_BENCH_SIZE * HWRNG_HEALTH_BENCH_ROUNDS,
+          rc);
+    memset(buf, 0, sizeof(buf));
+}
+
+#endif /* WITH_HWRNG_HEALTH_BENCHMARK */
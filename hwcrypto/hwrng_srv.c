@@ -19,40 +19,170 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <lk/list.h>
+#include <lk/macros.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/auxv.h>
+#include <sys/mman.h>
 #include <uapi/err.h>
 
 #include <hwcrypto/hwrng_dev.h>
+#include <hwcrypto/hwrng_srv.h>
+#include <hwcrypto_consts.h>
 #include <interface/hwrng/hwrng.h>
 #include <lib/tipc/tipc.h>
+#include <trusty/time.h>
 #include <trusty_log.h>
 
+#include "event_loop.h"
+#include "hwrng_srv_priv.h"
+#include "slab_pool.h"
+#include "stats.h"
+
 #define HWRNG_SRV_NAME HWRNG_PORT
+#define HWRNG_DRBG_SRV_NAME HWRNG_DRBG_PORT
 #define MAX_HWRNG_MSG_SIZE 4096
 
+/*
+ * Number of MAX_HWRNG_MSG_SIZE chunks of random data kept ready in the
+ * reservoir. Can be overridden from the build configuration.
+ */
+#ifndef HWRNG_RESERVOIR_PAGES
+#define HWRNG_RESERVOIR_PAGES 4
+#endif
+
+#define HWRNG_RESERVOIR_SIZE (HWRNG_RESERVOIR_PAGES * MAX_HWRNG_MSG_SIZE)
+STATIC_ASSERT(HWRNG_RESERVOIR_SIZE >= MAX_HWRNG_MSG_SIZE);
+
+/*
+ * Number of bytes each pending request is credited with per scheduling round.
+ * Can be overridden from the build configuration.
+ */
+#ifndef HWRNG_SCHED_QUANTUM
+#define HWRNG_SCHED_QUANTUM MAX_HWRNG_MSG_SIZE
+#endif
+
+/*
+ * Number of outstanding bytes at which the service stops reading further
+ * requests from a channel until they have been served, and the base of the
+ * default limit for all channels of one client. A single request is never
+ * refused for exceeding it. Can be overridden from the build configuration.
+ */
+#ifndef HWRNG_CHAN_MAX_PENDING
+#define HWRNG_CHAN_MAX_PENDING HWRNG_MEMREF_MAX_SIZE
+#endif
+
+#ifndef HWRNG_CLIENT_QUOTA
+#define HWRNG_CLIENT_QUOTA (4 * HWRNG_CHAN_MAX_PENDING)
+#endif
+
+/*
+ * Number of requests a client can send on one channel before the service
+ * reads any of them. Can be overridden from the build configuration.
+ */
+#ifndef HWRNG_PORT_QUEUE_LEN
+#define HWRNG_PORT_QUEUE_LEN 4
+#endif
+
+/*
+ * Number of client records kept around for statistics after all of their
+ * channels have been closed
+ */
+#ifndef HWRNG_MAX_CLIENTS
+#define HWRNG_MAX_CLIENTS 16
+#endif
+
+/**
+ * struct hwrng_client - quota accounting for all channels of one client
+ * @node:            entry in hwrng_client_list, least recently used first
+ * @refs:            number of open channels of this client
+ * @stats:           quota and usage reported by hwrng_get_client_stats()
+ */
+struct hwrng_client {
+    struct list_node node;
+    size_t refs;
+    struct hwrng_client_stats stats;
+};
+
 struct hwrng_chan_ctx {
     struct tipc_event_handler evt_handler;
     struct list_node node;
+    struct hwrng_client* client;
     handle_t chan;
     size_t req_size;
+    size_t deficit;
+    int64_t queued_ns;
+    size_t served;
     bool send_blocked;
+    bool drbg;
+
+    /* mapping of the client buffer for a pending memref fill request */
+    handle_t fill_memref;
+    uint8_t* fill_buf;
+    size_t fill_map_size;
+    size_t fill_pos;
 };
 
 static void hwrng_port_handler(const uevent_t* ev, void* priv);
 static void hwrng_chan_handler(const uevent_t* ev, void* priv);
 
 static handle_t hwrng_port = INVALID_IPC_HANDLE;
+static handle_t hwrng_drbg_port = INVALID_IPC_HANDLE;
 
 static struct tipc_event_handler hwrng_port_evt_handler = {
         .proc = hwrng_port_handler,
 };
 
+static struct slab_pool hwrng_ctx_pool;
+
 static uint8_t rng_data[MAX_HWRNG_MSG_SIZE];
 
 static struct list_node hwrng_req_list = LIST_INITIAL_VALUE(hwrng_req_list);
 
+static struct list_node hwrng_client_list =
+        LIST_INITIAL_VALUE(hwrng_client_list);
+static size_t hwrng_client_cnt;
+
+/*
+ * Ring buffer of random data pre-fetched from the device while hwcrypto is
+ * idle. @fill bytes starting at @head are valid, everything else is zero.
+ */
+static struct {
+    uint8_t data[HWRNG_RESERVOIR_SIZE];
+    size_t head;
+    size_t fill;
+    bool refill_failed;
+    uint64_t hits;
+    uint64_t misses;
+} rsv;
+
+/*
+ * The asynchronous device request in flight, if any. The device only ever
+ * fills the reservoir, so its output is health tested before any client can
+ * see it, and a client cannot tamper with it while it is being tested.
+ */
+static struct {
+    bool busy;
+    bool starting;
+    bool waiting;
+    bool completed;
+    int rc;
+    uint8_t* buf;
+    size_t len;
+} dev_op;
+
+/* Request scheduler statistics */
+static struct {
+    size_t queue_depth;
+    size_t max_queue_depth;
+    uint64_t completed;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t rejected_reqs;
+    uint64_t rejected_bytes;
+} sched;
+
 /****************************************************************************/
 
 /*
@@ -73,20 +203,516 @@ static void _hexdump8(const void* ptr, size_t len) {
     }
 }
 
+static void hwrng_kick_req_queue(void);
+
+__WEAK size_t hwrng_dev_get_client_quota(const uuid_t* uuid) {
+    return HWRNG_CLIENT_QUOTA;
+}
+
+/*
+ * Find or create the quota record of the client with @uuid
+ */
+static struct hwrng_client* hwrng_client_get(const uuid_t* uuid) {
+    struct hwrng_client* client;
+    struct hwrng_client* victim = NULL;
+
+    list_for_every_entry(&hwrng_client_list, client, struct hwrng_client,
+                         node) {
+        if (!memcmp(&client->stats.uuid, uuid, sizeof(*uuid)))
+            goto found;
+        if (!victim && !client->refs)
+            victim = client;
+    }
+
+    if (hwrng_client_cnt >= HWRNG_MAX_CLIENTS && victim) {
+        /* forget the least recently used client that has no channels */
+        client = victim;
+    } else {
+        client = calloc(1, sizeof(*client));
+        if (!client)
+            return NULL;
+        hwrng_client_cnt++;
+        list_add_tail(&hwrng_client_list, &client->node);
+    }
+
+    memset(&client->stats, 0, sizeof(client->stats));
+    client->stats.uuid = *uuid;
+    client->stats.quota = hwrng_dev_get_client_quota(uuid);
+
+found:
+    client->refs++;
+    list_delete(&client->node);
+    list_add_tail(&hwrng_client_list, &client->node);
+    return client;
+}
+
+/*
+ * Check the quota of the client of @ctx for queueing @len more bytes
+ *
+ * The per-channel limit is not checked here, hwrng_chan_handler() enforces
+ * it by not reading more requests.
+ *
+ * Return: true if the request may be queued, false if the client has to
+ * retry later.
+ */
+static bool hwrng_client_admit(struct hwrng_chan_ctx* ctx, size_t len) {
+    struct hwrng_client_stats* stats = &ctx->client->stats;
+
+    if (len > stats->quota - MIN(stats->outstanding, stats->quota)) {
+        stats->rejected_reqs++;
+        sched.rejected_reqs++;
+        sched.rejected_bytes += len;
+        return false;
+    }
+
+    stats->outstanding += len;
+    stats->max_outstanding = MAX(stats->max_outstanding, stats->outstanding);
+    return true;
+}
+
+/*
+ * Account for @len bytes of the pending request of @ctx being served
+ */
+static void hwrng_consume(struct hwrng_chan_ctx* ctx, size_t len) {
+    ctx->req_size -= len;
+    ctx->deficit -= MIN(len, ctx->deficit);
+    ctx->served += len;
+    ctx->client->stats.outstanding -= len;
+    ctx->client->stats.served_bytes += len;
+}
+
+/*
+ * Drop whatever is left of the pending request of @ctx
+ */
+static void hwrng_cancel_req(struct hwrng_chan_ctx* ctx) {
+    ctx->client->stats.outstanding -= ctx->req_size;
+    ctx->req_size = 0;
+    ctx->deficit = 0;
+}
+
+/*
+ * Account for the pending request of @ctx in the per-command statistics
+ *
+ * Return: nanoseconds since the request was queued.
+ */
+static uint64_t hwrng_record_req(struct hwrng_chan_ctx* ctx, bool error) {
+    enum hwcrypto_stats_id id = HWCRYPTO_STATS_HWRNG_GET;
+
+    if (ctx->fill_buf)
+        id = HWCRYPTO_STATS_HWRNG_MEMREF;
+    else if (ctx->drbg)
+        id = HWCRYPTO_STATS_HWRNG_DRBG;
+
+    return hwcrypto_stats_record(id, ctx->queued_ns, ctx->served, error);
+}
+
+static void hwrng_free_chan(struct hwrng_chan_ctx* ctx) {
+    ctx->client->refs--;
+    slab_pool_free(&hwrng_ctx_pool, ctx);
+}
+
+/*
+ * Release the mapping of the client buffer of a memref request
+ */
+static void hwrng_unmap_fill(struct hwrng_chan_ctx* ctx) {
+    munmap(ctx->fill_buf, ctx->fill_map_size);
+    close(ctx->fill_memref);
+    ctx->fill_buf = NULL;
+    ctx->fill_memref = INVALID_IPC_HANDLE;
+}
+
 /*
  * Close specified HWRNG service channel
  */
 static void hwrng_close_chan(struct hwrng_chan_ctx* ctx) {
+    hwcrypto_cancel_events(ctx->chan);
     close(ctx->chan);
+    ctx->chan = INVALID_IPC_HANDLE;
 
-    if (list_in_list(&ctx->node))
+    if (list_in_list(&ctx->node)) {
+        hwrng_record_req(ctx, true);
         list_delete(&ctx->node);
+        sched.queue_depth--;
+    }
+    hwrng_cancel_req(ctx);
+
+    if (ctx->fill_buf)
+        hwrng_unmap_fill(ctx);
+
+    hwrng_free_chan(ctx);
+}
+
+/*
+ * Apply the result of the device request in dev_op
+ */
+static void hwrng_dev_op_finish(void) {
+    int rc = dev_op.rc;
+    size_t len = dev_op.len;
+
+    assert(dev_op.busy && dev_op.completed);
+
+    dev_op.busy = false;
+
+    if (rc == NO_ERROR)
+        rc = hwrng_health_test(dev_op.buf, len);
+
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to refill hwrng reservoir\n", rc);
+        memset(dev_op.buf, 0, len);
+        /* don't retry until the next client request comes in */
+        rsv.refill_failed = true;
+        return;
+    }
+
+    rsv.fill += len;
+}
+
+/*
+ * Completion callback for hwrng_dev_start_rng_data()
+ */
+static void hwrng_dev_done(int rc, void* priv) {
+    dev_op.rc = rc;
+    dev_op.completed = true;
+
+    /*
+     * completed synchronously, hwrng_dev_op_start() or hwrng_dev_op_wait()
+     * takes care of it
+     */
+    if (dev_op.starting || dev_op.waiting)
+        return;
+
+    hwrng_dev_op_finish();
+    hwrng_kick_req_queue();
+}
+
+/*
+ * Start an asynchronous device request for @len bytes into @buf, which is part
+ * of the reservoir
+ *
+ * If the provider completes the request right away, its result has been
+ * applied by the time this function returns.
+ */
+static int hwrng_dev_op_start(uint8_t* buf, size_t len) {
+    int rc;
+
+    assert(!dev_op.busy);
+
+    dev_op.busy = true;
+    dev_op.completed = false;
+    dev_op.starting = true;
+    dev_op.buf = buf;
+    dev_op.len = len;
+
+    rc = hwrng_dev_start_rng_data(buf, len, hwrng_dev_done, NULL);
+    dev_op.starting = false;
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to start hwrng request\n", rc);
+        dev_op.busy = false;
+        /* don't retry until the next client request comes in */
+        rsv.refill_failed = true;
+        return rc;
+    }
+
+    if (dev_op.completed)
+        hwrng_dev_op_finish();
+
+    return NO_ERROR;
+}
+
+/*
+ * Block until the outstanding device request has completed
+ *
+ * Channels waiting for the request are not kicked, the reservoir is not full
+ * after a synchronous read, so the idle refill in the main loop does that.
+ */
+static void hwrng_dev_op_wait(void) {
+    dev_op.waiting = true;
+    while (!dev_op.completed) {
+        uint32_t timeout = hwrng_dev_poll();
+        if (!dev_op.completed && timeout != INFINITE_TIME)
+            trusty_nanosleep(0, 0, (uint64_t)timeout * 1000 * 1000);
+    }
+    dev_op.waiting = false;
+
+    hwrng_dev_op_finish();
+}
+
+/*
+ * Start topping up the reservoir by at most one contiguous chunk
+ */
+static int hwrng_reservoir_start_refill(void) {
+    size_t tail = (rsv.head + rsv.fill) % HWRNG_RESERVOIR_SIZE;
+    size_t len = HWRNG_RESERVOIR_SIZE - rsv.fill;
+
+    if (dev_op.busy)
+        return ERR_BUSY;
+
+    /* fill at most one contiguous chunk per call to keep latency bounded */
+    len = MIN(len, HWRNG_RESERVOIR_SIZE - tail);
+    len = MIN(len, MAX_HWRNG_MSG_SIZE);
+    if (!len)
+        return NO_ERROR;
+
+    return hwrng_dev_op_start(rsv.data + tail, len);
+}
+
+/*
+ * Make sure the reservoir holds at least @len bytes
+ *
+ * Return: NO_ERROR if the data is there, %ERR_NOT_READY if the caller has to
+ * wait for the device, or another negative error code.
+ */
+static int hwrng_reservoir_reserve(size_t len) {
+    int rc;
+    bool hit = true;
+
+    assert(len <= HWRNG_RESERVOIR_SIZE);
+
+    while (len > rsv.fill) {
+        hit = false;
+        if (rsv.refill_failed)
+            return ERR_IO;
+        if (dev_op.busy)
+            return ERR_NOT_READY; /* completion kicks the queue again */
+
+        rc = hwrng_reservoir_start_refill();
+        if (rc != NO_ERROR)
+            return rc;
+    }
+
+    if (hit)
+        rsv.hits++;
+    else
+        rsv.misses++;
+    return NO_ERROR;
+}
+
+/*
+ * Discard @len bytes that have been handed out from the reservoir
+ */
+static void hwrng_reservoir_consume(size_t len) {
+    size_t first = MIN(len, HWRNG_RESERVOIR_SIZE - rsv.head);
+
+    /* never hand out the same bytes twice */
+    memset(rsv.data + rsv.head, 0, first);
+    memset(rsv.data, 0, len - first);
+
+    rsv.head = (rsv.head + len) % HWRNG_RESERVOIR_SIZE;
+    rsv.fill -= len;
+}
+
+/*
+ * Send @len bytes from the reservoir to @chan and discard them on success
+ */
+static int hwrng_reservoir_send(handle_t chan, size_t len) {
+    int rc;
+    size_t first = MIN(len, HWRNG_RESERVOIR_SIZE - rsv.head);
+
+    assert(len <= rsv.fill);
+
+    rc = tipc_send2(chan, rsv.data + rsv.head, first, rsv.data, len - first);
+    if (rc < 0)
+        return rc;
+
+    hwrng_reservoir_consume(len);
+    return rc;
+}
+
+/*
+ * Copy @len bytes from the reservoir to @dst and discard them
+ */
+static void hwrng_reservoir_copy(uint8_t* dst, size_t len) {
+    size_t first = MIN(len, HWRNG_RESERVOIR_SIZE - rsv.head);
 
-    free(ctx);
+    assert(len <= rsv.fill);
+
+    memcpy(dst, rsv.data + rsv.head, first);
+    memcpy(dst + first, rsv.data, len - first);
+
+    hwrng_reservoir_consume(len);
+}
+
+/*
+ * Get @len bytes of DRBG output and send them to @chan
+ */
+static int hwrng_send_drbg_data(handle_t chan, size_t len) {
+    int rc;
+
+    rc = hwrng_drbg_generate(rng_data, len);
+    if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to get DRBG data\n", rc);
+        return rc;
+    }
+
+    rc = tipc_send1(chan, rng_data, len);
+    memset(rng_data, 0, len);
+    return rc;
+}
+
+/*
+ * Get @len bytes of hwrng data for @ctx and send them
+ *
+ * Return: number of bytes sent, %ERR_NOT_READY if the request has to wait for
+ * the device, or another negative error code.
+ */
+static int hwrng_send_rng_data(struct hwrng_chan_ctx* ctx, size_t len) {
+    int rc;
+
+    if (ctx->drbg)
+        return hwrng_send_drbg_data(ctx->chan, len);
+
+    /* all device output goes through the reservoir */
+    rc = hwrng_reservoir_reserve(len);
+    if (rc != NO_ERROR)
+        return rc;
+
+    return hwrng_reservoir_send(ctx->chan, len);
+}
+
+/*
+ * Fill the next @len bytes of the client buffer of a memref request
+ *
+ * Device output is copied from the reservoir rather than written to the
+ * client mapping directly, the client can modify its buffer at any time and
+ * must not see data before it has passed the health test.
+ *
+ * Return: NO_ERROR once the data is in place, %ERR_NOT_READY if the request
+ * has to wait for the device, or another negative error code.
+ */
+static int hwrng_fill_rng_data(struct hwrng_chan_ctx* ctx, size_t len) {
+    int rc;
+    uint8_t* dst = ctx->fill_buf + ctx->fill_pos;
+
+    if (!ctx->drbg) {
+        len = MIN(len, HWRNG_RESERVOIR_SIZE);
+        rc = hwrng_reservoir_reserve(len);
+        if (rc != NO_ERROR)
+            return rc;
+
+        hwrng_reservoir_copy(dst, len);
+    } else {
+        rc = hwrng_drbg_generate(dst, len);
+        if (rc != NO_ERROR) {
+            TLOGE("failed (%d) to fill memref\n", rc);
+            return rc;
+        }
+    }
+
+    ctx->fill_pos += len;
+    hwrng_consume(ctx, len);
+    return NO_ERROR;
+}
+
+int hwrng_get_rng_data(uint8_t* buf, size_t buf_len) {
+    int rc;
+
+    /* an internal caller is as good a reason to retry as a client request */
+    rsv.refill_failed = false;
+
+    while (buf_len) {
+        size_t len = MIN(buf_len, HWRNG_RESERVOIR_SIZE);
+
+        rc = hwrng_reservoir_reserve(len);
+        if (rc == ERR_NOT_READY) {
+            hwrng_dev_op_wait();
+            continue;
+        }
+        if (rc != NO_ERROR)
+            return rc;
+
+        hwrng_reservoir_copy(buf, len);
+        buf += len;
+        buf_len -= len;
+    }
+
+    return NO_ERROR;
+}
+
+/*
+ * Complete a memref request with @status, the channel stays usable
+ *
+ * Return: NO_ERROR if the reply has been sent, a negative error code
+ * otherwise.
+ */
+static int hwrng_send_memref_rsp(struct hwrng_chan_ctx* ctx,
+                                 int status,
+                                 size_t len) {
+    struct hwrng_memref_rsp rsp = {
+            .status = status,
+            .len = len,
+    };
+
+    int rc = tipc_send1(ctx->chan, &rsp, sizeof(rsp));
+    return rc < 0 ? rc : NO_ERROR;
+}
+
+/*
+ * Unmap the client buffer of a memref request and report @status
+ */
+static int hwrng_finish_fill(struct hwrng_chan_ctx* ctx, int status) {
+    size_t len = ctx->fill_pos;
+
+    hwrng_unmap_fill(ctx);
+
+    return hwrng_send_memref_rsp(ctx, status, len);
+}
+
+/*
+ * Remove a fully served request from the queue and account for its wait time
+ */
+static void hwrng_complete_req(struct hwrng_chan_ctx* ctx, bool error) {
+    uint64_t wait_ns = hwrng_record_req(ctx, error);
+
+    list_delete(&ctx->node);
+    hwrng_cancel_req(ctx);
+
+    sched.queue_depth--;
+    sched.completed++;
+    sched.total_wait_ns += wait_ns;
+    sched.max_wait_ns = MAX(sched.max_wait_ns, wait_ns);
+}
+
+/*
+ * Give @ctx one quantum worth of data
+ */
+static int hwrng_serve_chan(struct hwrng_chan_ctx* ctx) {
+    int rc;
+
+    /*
+     * Credit left over from a pass that had to wait for the device is kept,
+     * but a channel that keeps waiting must not pile up more of it.
+     */
+    if (ctx->deficit < HWRNG_SCHED_QUANTUM)
+        ctx->deficit += HWRNG_SCHED_QUANTUM;
+
+    do {
+        size_t len = MIN(ctx->req_size, ctx->deficit);
+
+        if (ctx->fill_buf) {
+            /* memref replies are not limited by the message size */
+            rc = hwrng_fill_rng_data(ctx, len);
+            if (rc < 0)
+                return rc;
+            continue;
+        }
+
+        if (len > MAX_HWRNG_MSG_SIZE)
+            len = MAX_HWRNG_MSG_SIZE;
+
+        rc = hwrng_send_rng_data(ctx, len);
+        if (rc < 0)
+            return rc;
+
+        hwrng_consume(ctx, len);
+    } while (ctx->req_size && ctx->deficit);
+
+    return NO_ERROR;
 }
 
 /*
- * Handle HWRNG request queue
+ * Run one round-robin pass over the HWRNG request queue
+ *
+ * Return: true if another pass would make progress
  */
 static bool hwrng_handle_req_queue(void) {
     int rc;
@@ -102,23 +728,26 @@ static bool hwrng_handle_req_queue(void) {
         if (ctx->send_blocked)
             continue; /* cant service it rignt now */
 
-        size_t len = ctx->req_size;
-
-        if (len > MAX_HWRNG_MSG_SIZE)
-            len = MAX_HWRNG_MSG_SIZE;
-
-        /* get hwrng data */
-        rc = hwrng_dev_get_rng_data(rng_data, len);
-        if (rc != NO_ERROR) {
-            TLOGE("failed (%d) to get hwrng data\n", rc);
-            hwrng_close_chan(ctx);
+        rc = hwrng_serve_chan(ctx);
+        if (rc == ERR_NOT_READY) {
+            /* waiting for the device, completion kicks the queue again */
             continue;
+        } else if (rc < 0 && ctx->fill_buf) {
+            /* report the failure, the client can retry */
+            hwrng_complete_req(ctx, true);
+            rc = hwrng_finish_fill(ctx, rc);
+        } else if (rc >= 0 && ctx->req_size == 0) {
+            /* remove it from pending list */
+            hwrng_complete_req(ctx, false);
+            if (ctx->fill_buf)
+                rc = hwrng_finish_fill(ctx, NO_ERROR);
+        } else if (rc >= 0) {
+            need_more = true;
         }
 
-        /* send reply */
-        rc = tipc_send1(ctx->chan, rng_data, len);
         if (rc < 0) {
-            if (rc == ERR_NOT_ENOUGH_BUFFER) {
+            if (rc == ERR_NOT_ENOUGH_BUFFER && !ctx->fill_buf &&
+                list_in_list(&ctx->node)) {
                 /* mark it as send_blocked */
                 ctx->send_blocked = true;
             } else {
@@ -126,27 +755,120 @@ static bool hwrng_handle_req_queue(void) {
                 TLOGE("failed (%d) to send_reply\n", rc);
                 hwrng_close_chan(ctx);
             }
-            continue;
         }
+    }
 
-        ctx->req_size -= len;
+    return need_more;
+}
 
-        if (ctx->req_size == 0) {
-            /* remove it from pending list */
-            list_delete(&ctx->node);
-        } else {
-            need_more = true;
+bool hwrng_reservoir_needs_refill(void) {
+    return !dev_op.busy && !rsv.refill_failed &&
+           rsv.fill < HWRNG_RESERVOIR_SIZE;
+}
+
+int hwrng_reservoir_refill(void) {
+    int rc = hwrng_reservoir_start_refill();
+
+    /* let requests that were waiting for the device use the new data */
+    if (rc == NO_ERROR && !dev_op.busy && !list_is_empty(&hwrng_req_list))
+        hwrng_kick_req_queue();
+
+    return rc;
+}
+
+void hwrng_get_stats(struct hwrng_srv_stats* stats) {
+    assert(stats);
+
+    stats->reservoir_size = HWRNG_RESERVOIR_SIZE;
+    stats->reservoir_fill = rsv.fill;
+    stats->reservoir_hits = rsv.hits;
+    stats->reservoir_misses = rsv.misses;
+    stats->queue_depth = sched.queue_depth;
+    stats->max_queue_depth = sched.max_queue_depth;
+    stats->completed_reqs = sched.completed;
+    stats->total_wait_ns = sched.total_wait_ns;
+    stats->max_wait_ns = sched.max_wait_ns;
+    hwrng_drbg_get_stats(&stats->drbg_bytes, &stats->drbg_reseeds);
+    hwrng_health_get_stats(stats);
+    stats->rejected_reqs = sched.rejected_reqs;
+    stats->rejected_bytes = sched.rejected_bytes;
+}
+
+int hwrng_get_client_stats(size_t idx, struct hwrng_client_stats* stats) {
+    struct hwrng_client* client;
+
+    assert(stats);
+
+    list_for_every_entry(&hwrng_client_list, client, struct hwrng_client,
+                         node) {
+        if (!idx--) {
+            *stats = client->stats;
+            return NO_ERROR;
         }
     }
-
-    return need_more;
+    return ERR_NOT_FOUND;
 }
 
 /*
  * Check if we can handle request queue
  */
 static void hwrng_kick_req_queue(void) {
-    hwrng_handle_req_queue();
+    /* keep going until every channel is either satisfied or send-blocked */
+    while (hwrng_handle_req_queue())
+        ;
+}
+
+/*
+ * Add a request for @len bytes to the HWRNG request queue
+ */
+static void hwrng_queue_req(struct hwrng_chan_ctx* ctx, size_t len) {
+    ctx->req_size = len;
+    ctx->deficit = 0;
+    ctx->served = 0;
+    trusty_gettime(0, &ctx->queued_ns);
+    list_add_tail(&hwrng_req_list, &ctx->node);
+
+    sched.queue_depth++;
+    sched.max_queue_depth = MAX(sched.max_queue_depth, sched.queue_depth);
+}
+
+/*
+ * Map the client buffer of a memref fill request and queue it
+ */
+static int hwrng_queue_fill(struct hwrng_chan_ctx* ctx,
+                            const struct hwrng_memref_req* req,
+                            handle_t memref) {
+    size_t page_size = getauxval(AT_PAGESZ);
+
+    if (req->reserved || !req->len || req->len > HWRNG_MEMREF_MAX_SIZE) {
+        TLOGE("invalid memref request (%u bytes)\n", req->len);
+        close(memref);
+        return hwrng_send_memref_rsp(ctx, ERR_INVALID_ARGS, 0);
+    }
+
+    if (!hwrng_client_admit(ctx, req->len)) {
+        TLOGE("memref request (%u bytes) on chan %d over quota\n", req->len,
+              ctx->chan);
+        close(memref);
+        return hwrng_send_memref_rsp(ctx, ERR_BUSY, 0);
+    }
+
+    size_t map_size = round_up(req->len, page_size);
+    void* buf = mmap(NULL, map_size, PROT_READ | PROT_WRITE, 0, memref, 0);
+    if (buf == MAP_FAILED) {
+        TLOGE("failed to mmap memref for chan %d\n", ctx->chan);
+        ctx->client->stats.outstanding -= req->len;
+        close(memref);
+        return hwrng_send_memref_rsp(ctx, ERR_BAD_HANDLE, 0);
+    }
+
+    ctx->fill_memref = memref;
+    ctx->fill_buf = buf;
+    ctx->fill_map_size = map_size;
+    ctx->fill_pos = 0;
+
+    hwrng_queue_req(ctx, req->len);
+    return NO_ERROR;
 }
 
 /*
@@ -154,25 +876,90 @@ static void hwrng_kick_req_queue(void) {
  */
 static int hwrng_chan_handle_msg(struct hwrng_chan_ctx* ctx) {
     int rc;
-    struct hwrng_req req;
+    handle_t memref = INVALID_IPC_HANDLE;
+    union {
+        struct hwrng_req req;
+        struct hwrng_memref_req memref_req;
+    } req;
+    struct iovec iov = {
+            .iov_base = &req,
+            .iov_len = sizeof(req),
+    };
+    struct ipc_msg msg = {
+            .iov = &iov,
+            .num_iov = 1,
+            .handles = &memref,
+    };
+    struct ipc_msg_info msg_inf;
 
     assert(ctx);
 
     /* read request */
-    rc = tipc_recv1(ctx->chan, sizeof(req), &req, sizeof(req));
+    rc = get_msg(ctx->chan, &msg_inf);
+    if (rc == ERR_NO_MSG) {
+        return rc; /* all queued requests have been read */
+    } else if (rc != NO_ERROR) {
+        TLOGE("failed (%d) to get msg for chan %d\n", rc, ctx->chan);
+        return rc;
+    }
+
+    if (msg_inf.num_handles > 1) {
+        TLOGE("unexpected handles (%u) on chan %d\n", msg_inf.num_handles,
+              ctx->chan);
+        put_msg(ctx->chan, msg_inf.id);
+        return ERR_NOT_VALID;
+    }
+
+    msg.num_handles = msg_inf.num_handles;
+    rc = read_msg(ctx->chan, msg_inf.id, 0, &msg);
+    put_msg(ctx->chan, msg_inf.id);
     if (rc < 0) {
         TLOGE("failed (%d) to receive msg for chan %d\n", rc, ctx->chan);
         return rc;
     }
 
+    /* a memref fill must complete before anything else is requested */
+    if (ctx->fill_buf) {
+        TLOGE("request on chan %d while memref fill is pending\n",
+              ctx->chan);
+        if (msg_inf.num_handles)
+            close(memref);
+        return ERR_BUSY;
+    }
+
+    if (msg_inf.num_handles) {
+        if ((size_t)rc != sizeof(req.memref_req) ||
+            list_in_list(&ctx->node)) {
+            TLOGE("invalid memref request on chan %d\n", ctx->chan);
+            close(memref);
+            return ERR_NOT_VALID;
+        }
+        return hwrng_queue_fill(ctx, &req.memref_req, memref);
+    }
+
+    if ((size_t)rc < sizeof(req.req)) {
+        TLOGE("short request (%d) on chan %d\n", rc, ctx->chan);
+        return ERR_BAD_LEN;
+    }
+
+    /*
+     * The plain protocol has no way to report a status: anything sent back
+     * would be taken for random data. Closing the channel is the retry later
+     * indication for these clients.
+     */
+    if (!hwrng_client_admit(ctx, req.req.len)) {
+        TLOGE("request (%u bytes) on chan %d over quota\n", req.req.len,
+              ctx->chan);
+        return ERR_BUSY;
+    }
+
     /* check if we already have request in progress */
     if (list_in_list(&ctx->node)) {
         /* extend it */
-        ctx->req_size += req.len;
+        ctx->req_size += req.req.len;
     } else {
         /* queue it */
-        ctx->req_size = req.len;
-        list_add_tail(&hwrng_req_list, &ctx->node);
+        hwrng_queue_req(ctx, req.req.len);
     }
 
     return 0;
@@ -189,6 +976,9 @@ static void hwrng_chan_handler(const uevent_t* ev, void* priv) {
 
     tipc_handle_chan_errors(ev);
 
+    /* give the reservoir another chance after a device error */
+    rsv.refill_failed = false;
+
     if (ev->event & IPC_HANDLE_POLL_HUP) {
         hwrng_close_chan(ctx);
     } else {
@@ -197,8 +987,15 @@ static void hwrng_chan_handler(const uevent_t* ev, void* priv) {
         }
 
         if (ev->event & IPC_HANDLE_POLL_MSG) {
-            int rc = hwrng_chan_handle_msg(ctx);
-            if (rc) {
+            /*
+             * Read the requests the client has queued up, but leave the rest
+             * unread once the channel is at its limit. MSG stays asserted,
+             * so they are read on a later event once the channel has drained.
+             */
+            int rc = NO_ERROR;
+            while (rc == NO_ERROR && ctx->req_size < HWRNG_CHAN_MAX_PENDING)
+                rc = hwrng_chan_handle_msg(ctx);
+            if (rc != NO_ERROR && rc != ERR_NO_MSG) {
                 hwrng_close_chan(ctx);
             }
         }
@@ -228,23 +1025,33 @@ static void hwrng_port_handler(const uevent_t* ev, void* priv) {
         chan = (handle_t)rc;
 
         /* allocate state */
-        struct hwrng_chan_ctx* ctx = calloc(1, sizeof(*ctx));
+        struct hwrng_chan_ctx* ctx = slab_pool_alloc(&hwrng_ctx_pool);
         if (!ctx) {
             TLOGE("failed to alloc state for chan %d\n", chan);
             close(chan);
             return;
         }
 
+        ctx->client = hwrng_client_get(&peer_uuid);
+        if (!ctx->client) {
+            TLOGE("failed to alloc client state for chan %d\n", chan);
+            slab_pool_free(&hwrng_ctx_pool, ctx);
+            close(chan);
+            return;
+        }
+
         /* init channel state */
         ctx->evt_handler.priv = ctx;
         ctx->evt_handler.proc = hwrng_chan_handler;
         ctx->chan = chan;
+        ctx->drbg = ev->handle == hwrng_drbg_port;
+        ctx->fill_memref = INVALID_IPC_HANDLE;
 
         /* attach channel handler */
         rc = set_cookie(chan, &ctx->evt_handler);
         if (rc) {
             TLOGE("failed (%d) to set_cookie on chan %d\n", rc, chan);
-            free(ctx);
+            hwrng_free_chan(ctx);
             close(chan);
             return;
         }
@@ -259,8 +1066,19 @@ int hwrng_start_service(void) {
 
     TLOGD("Start HWRNG service\n");
 
+    /* large fills must not delay the key services */
+    hwcrypto_set_event_priority(hwrng_port_handler, HWCRYPTO_EVENT_PRIO_BULK);
+    hwcrypto_set_event_priority(hwrng_chan_handler, HWCRYPTO_EVENT_PRIO_BULK);
+
+    rc = slab_pool_init(&hwrng_ctx_pool, "hwrng_chan_ctx",
+                        sizeof(struct hwrng_chan_ctx), HWRNG_MAX_CHANNELS);
+    if (rc != NO_ERROR) {
+        TLOGE("Failed (%d) to allocate channel pool\n", rc);
+        return rc;
+    }
+
     /* create HWRNG port */
-    rc = port_create(HWRNG_SRV_NAME, 1, MAX_HWRNG_MSG_SIZE,
+    rc = port_create(HWRNG_SRV_NAME, HWRNG_PORT_QUEUE_LEN, MAX_HWRNG_MSG_SIZE,
                      IPC_PORT_ALLOW_TA_CONNECT);
     if (rc < 0) {
         TLOGE("Failed (%d) to create port '%s'\n", rc, HWRNG_SRV_NAME);
@@ -270,15 +1088,32 @@ int hwrng_start_service(void) {
     hwrng_port = (handle_t)rc;
     set_cookie(hwrng_port, &hwrng_port_evt_handler);
 
+    /* create DRBG port */
+    rc = port_create(HWRNG_DRBG_SRV_NAME, HWRNG_PORT_QUEUE_LEN,
+                     MAX_HWRNG_MSG_SIZE, IPC_PORT_ALLOW_TA_CONNECT);
+    if (rc < 0) {
+        TLOGE("Failed (%d) to create port '%s'\n", rc, HWRNG_DRBG_SRV_NAME);
+        goto err_drbg_port_create;
+    }
+
+    hwrng_drbg_port = (handle_t)rc;
+    set_cookie(hwrng_drbg_port, &hwrng_port_evt_handler);
+
     rc = hwrng_dev_init();
     if (rc != NO_ERROR) {
         TLOGE("Failed (%d) to initialize HWRNG device\n", rc);
         goto err_hwrng_dev_init;
     }
 
+#if WITH_HWRNG_HEALTH_BENCHMARK
+    hwrng_health_benchmark();
+#endif
+
     return NO_ERROR;
 
 err_hwrng_dev_init:
+    close(hwrng_drbg_port);
+err_drbg_port_create:
     close(hwrng_port);
 err_port_create:
     return rc;
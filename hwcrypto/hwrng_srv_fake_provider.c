@@ -16,28 +16,179 @@
 
 #define TLOG_TAG "hwrng_fake_srv"
 
+#include <assert.h>
+#include <lk/compiler.h>
+#include <lk/macros.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <uapi/err.h>
 
 #include <hwcrypto/hwrng_dev.h>
+#include <trusty/time.h>
+#include <trusty_ipc.h>
 #include <trusty_log.h>
 
 #pragma message "Compiling FAKE HWRNG provider"
 
+/*
+ * The fake provider is a xoshiro256** generator with HWRNG_FAKE_LANES
+ * interleaved, independently seeded streams. It is NOT a source of entropy,
+ * but it is fast enough not to dominate benchmarks of the HWRNG service and
+ * the lanes are laid out so that the compiler can keep them in vector
+ * registers. The output only depends on HWRNG_FAKE_SEED, so it is
+ * reproducible across runs.
+ */
+#ifndef HWRNG_FAKE_SEED
+#define HWRNG_FAKE_SEED 0x5eed5eed5eed5eedULL
+#endif
+
+#define HWRNG_FAKE_LANES 4
+
+/*
+ * Simulated device latency in milliseconds, applied to every blocking and
+ * asynchronous request. Useful to measure how well the HWRNG service overlaps
+ * device requests with other work.
+ */
+#ifndef HWRNG_FAKE_LATENCY_MS
+#define HWRNG_FAKE_LATENCY_MS 0
+#endif
+
+#define HWRNG_FAKE_LATENCY_NS (HWRNG_FAKE_LATENCY_MS * 1000000LL)
+
+static uint64_t xs[4][HWRNG_FAKE_LANES];
+static bool seeded;
+
+__attribute__((no_sanitize("unsigned-integer-overflow"))) static uint64_t
+splitmix64(uint64_t* x) {
+    uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void hwrng_fake_seed(uint64_t seed) {
+    for (size_t i = 0; i < countof(xs); i++) {
+        for (size_t lane = 0; lane < HWRNG_FAKE_LANES; lane++) {
+            xs[i][lane] = splitmix64(&seed);
+        }
+    }
+    seeded = true;
+}
+
+static inline uint64_t rotl(uint64_t x, int k) {
+    return (x << k) | (x >> (64 - k));
+}
+
+/*
+ * Advance all lanes by one step and store one word per lane in @out
+ */
+__attribute__((no_sanitize("unsigned-integer-overflow"))) static void
+hwrng_fake_next(uint64_t out[HWRNG_FAKE_LANES]) {
+    for (size_t lane = 0; lane < HWRNG_FAKE_LANES; lane++) {
+        uint64_t t = xs[1][lane] << 17;
+
+        out[lane] = rotl(xs[1][lane] * 5, 7) * 9;
+
+        xs[2][lane] ^= xs[0][lane];
+        xs[3][lane] ^= xs[1][lane];
+        xs[1][lane] ^= xs[2][lane];
+        xs[0][lane] ^= xs[3][lane];
+        xs[2][lane] ^= t;
+        xs[3][lane] = rotl(xs[3][lane], 45);
+    }
+}
+
+static void hwrng_fake_fill(uint8_t* buf, size_t buf_len) {
+    uint64_t words[HWRNG_FAKE_LANES];
+
+    if (!seeded)
+        hwrng_fake_seed(HWRNG_FAKE_SEED);
+
+    while (buf_len >= sizeof(words)) {
+        hwrng_fake_next(words);
+        memcpy(buf, words, sizeof(words));
+        buf += sizeof(words);
+        buf_len -= sizeof(words);
+    }
+
+    if (buf_len) {
+        hwrng_fake_next(words);
+        memcpy(buf, words, buf_len);
+    }
+}
+
+/* Asynchronous request waiting for its simulated completion time */
+static struct {
+    bool busy;
+    uint8_t* buf;
+    size_t buf_len;
+    hwrng_dev_done_t done;
+    void* priv;
+    int64_t deadline_ns;
+} pending;
+
 int hwrng_dev_init(void) {
     TLOGE("Init FAKE!!!! HWRNG service provider\n");
     TLOGE("FAKE HWRNG service provider MUST be replaced with the REAL one\n");
+
+    hwrng_fake_seed(HWRNG_FAKE_SEED);
     return NO_ERROR;
 }
 
-static size_t counter = 1;
+int hwrng_dev_get_rng_data(uint8_t* buf, size_t buf_len) {
+    /* a real device cannot serve both interfaces at the same time */
+    assert(!pending.busy);
 
-__attribute__((no_sanitize("unsigned-integer-overflow"))) int
-hwrng_dev_get_rng_data(uint8_t* buf, size_t buf_len) {
-    for (uint8_t* end = buf + buf_len; buf < end; ++buf) {
-        *buf = counter++ & 0xff;
+    if (HWRNG_FAKE_LATENCY_NS)
+        trusty_nanosleep(0, 0, HWRNG_FAKE_LATENCY_NS);
+
+    hwrng_fake_fill(buf, buf_len);
+    return NO_ERROR;
+}
+
+int hwrng_dev_start_rng_data(uint8_t* buf,
+                             size_t buf_len,
+                             hwrng_dev_done_t done,
+                             void* priv) {
+    if (pending.busy)
+        return ERR_BUSY;
+
+    if (!HWRNG_FAKE_LATENCY_NS) {
+        hwrng_fake_fill(buf, buf_len);
+        done(NO_ERROR, priv);
+        return NO_ERROR;
     }
+
+    pending.busy = true;
+    pending.buf = buf;
+    pending.buf_len = buf_len;
+    pending.done = done;
+    pending.priv = priv;
+    trusty_gettime(0, &pending.deadline_ns);
+    pending.deadline_ns += HWRNG_FAKE_LATENCY_NS;
+
     return NO_ERROR;
 }
+
+uint32_t hwrng_dev_poll(void) {
+    int64_t now = 0;
+
+    if (!pending.busy)
+        return INFINITE_TIME;
+
+    trusty_gettime(0, &now);
+    if (now < pending.deadline_ns) {
+        /* round up so we don't wake up just before the deadline */
+        return (uint32_t)((pending.deadline_ns - now + 999999) / 1000000);
+    }
+
+    pending.busy = false;
+    hwrng_fake_fill(pending.buf, pending.buf_len);
+    pending.done(NO_ERROR, pending.priv);
+
+    /* the callback may have started the next request */
+    return pending.busy ? HWRNG_FAKE_LATENCY_MS : INFINITE_TIME;
+}
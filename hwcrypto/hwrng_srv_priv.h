@@ -16,9 +16,151 @@
 #pragma once
 
 #include <lk/compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <uapi/trusty_uuid.h>
+
+/**
+ * struct hwrng_srv_stats - HWRNG service statistics
+ * @reservoir_size:   capacity of the pre-fetched random data reservoir
+ * @reservoir_fill:   number of bytes currently available in the reservoir
+ * @reservoir_hits:   number of replies served from the reservoir
+ * @reservoir_misses: number of replies that had to read the device directly
+ * @queue_depth:      number of channels with a pending request
+ * @max_queue_depth:  highest @queue_depth seen so far
+ * @completed_reqs:   number of requests that have been fully served
+ * @total_wait_ns:    sum of queue-to-completion times of completed requests
+ * @max_wait_ns:      longest queue-to-completion time seen so far
+ * @drbg_bytes:       number of bytes generated by the DRBG
+ * @drbg_reseeds:     number of times the DRBG was (re)seeded from the device
+ * @health_bytes:     number of device output bytes run through health tests
+ * @health_ns:        time spent in the health tests
+ * @health_rct_failures: number of repetition count test failures
+ * @health_apt_failures: number of adaptive proportion test failures
+ * @rejected_reqs:    number of requests turned away because of quotas
+ * @rejected_bytes:   number of bytes asked for by @rejected_reqs
+ */
+struct hwrng_srv_stats {
+    size_t reservoir_size;
+    size_t reservoir_fill;
+    uint64_t reservoir_hits;
+    uint64_t reservoir_misses;
+    size_t queue_depth;
+    size_t max_queue_depth;
+    uint64_t completed_reqs;
+    uint64_t total_wait_ns;
+    uint64_t max_wait_ns;
+    uint64_t drbg_bytes;
+    uint64_t drbg_reseeds;
+    uint64_t health_bytes;
+    uint64_t health_ns;
+    uint64_t health_rct_failures;
+    uint64_t health_apt_failures;
+    uint64_t rejected_reqs;
+    uint64_t rejected_bytes;
+};
+
+/**
+ * struct hwrng_client_stats - per-client quota statistics
+ * @uuid:            UUID of the client application
+ * @quota:           maximum number of bytes the client may have outstanding
+ * @outstanding:     number of bytes currently requested but not yet served
+ * @max_outstanding: highest @outstanding seen so far
+ * @served_bytes:    number of bytes served to the client
+ * @rejected_reqs:   number of requests rejected because of @quota
+ */
+struct hwrng_client_stats {
+    uuid_t uuid;
+    size_t quota;
+    size_t outstanding;
+    size_t max_outstanding;
+    uint64_t served_bytes;
+    uint64_t rejected_reqs;
+};
 
 __BEGIN_CDECLS
 
 int hwrng_start_service(void);
 
+/*
+ * hwrng_reservoir_needs_refill() - check if the reservoir should be topped up
+ *
+ * Return: true if there is idle work to do for the HWRNG service.
+ */
+bool hwrng_reservoir_needs_refill(void);
+
+/*
+ * hwrng_reservoir_refill() - top up the reservoir by at most one chunk
+ *
+ * Intended to be called from the main loop when there are no pending events.
+ *
+ * Return: NO_ERROR on success, a negative error code otherwise.
+ */
+int hwrng_reservoir_refill(void);
+
+void hwrng_get_stats(struct hwrng_srv_stats* stats);
+
+/*
+ * hwrng_get_rng_data() - get health tested HWRNG output for hwcrypto itself
+ * @buf: buffer to be filled up
+ * @buf_len: requested amount of random data
+ *
+ * Takes the data from the reservoir and blocks until the device has refilled
+ * it if needed. Everything inside hwcrypto that needs device output must use
+ * this instead of hwrng_dev_get_rng_data(), which must not be called while
+ * the reservoir has an asynchronous request outstanding.
+ *
+ * Return: NO_ERROR on success, a negative error code otherwise.
+ */
+int hwrng_get_rng_data(uint8_t* buf, size_t buf_len);
+
+/*
+ * hwrng_get_client_stats() - get quota statistics of one client
+ * @idx: index of the client, starting at 0
+ * @stats: filled in on success
+ *
+ * Statistics are kept for up to %HWRNG_MAX_CLIENTS clients, including ones
+ * that have no open channels any more.
+ *
+ * Return: NO_ERROR on success, ERR_NOT_FOUND if @idx is past the last client.
+ */
+int hwrng_get_client_stats(size_t idx, struct hwrng_client_stats* stats);
+
+/*
+ * hwrng_drbg_generate() - get DRBG output seeded from the HWRNG device
+ * @buf: buffer to be filled up
+ * @buf_len: requested amount of random data
+ *
+ * The DRBG is instantiated on first use and reseeded from the device every
+ * %HWRNG_DRBG_RESEED_INTERVAL bytes.
+ *
+ * Return: NO_ERROR on success, a negative error code otherwise.
+ */
+int hwrng_drbg_generate(uint8_t* buf, size_t buf_len);
+
+void hwrng_drbg_get_stats(uint64_t* bytes, uint64_t* reseeds);
+
+/*
+ * hwrng_health_test() - run the SP 800-90B continuous health tests
+ * @buf: raw output of the HWRNG device
+ * @buf_len: number of bytes in @buf
+ *
+ * The tests keep their state across calls, so every byte the device produces
+ * has to be passed in exactly once and in order. On failure the test state is
+ * reset and the caller must discard @buf.
+ *
+ * Return: NO_ERROR if the data passed, ERR_IO otherwise.
+ */
+int hwrng_health_test(const uint8_t* buf, size_t buf_len);
+
+void hwrng_health_get_stats(struct hwrng_srv_stats* stats);
+
+/*
+ * hwrng_health_benchmark() - log the per-byte cost of the health tests
+ *
+ * Only available if built with WITH_HWRNG_HEALTH_BENCHMARK.
+ */
+void hwrng_health_benchmark(void);
+
 __END_CDECLS
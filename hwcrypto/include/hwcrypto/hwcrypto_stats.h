@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * HWCRYPTO_STATS_PORT - port reporting per-command statistics of the sample
+ * hwcrypto service
+ *
+ * A client sends a &struct hwcrypto_stats_req and gets one
+ * &struct hwcrypto_stats_rsp, or one &struct hwcrypto_stats_pool_rsp, back
+ * for every request.
+ */
+#define HWCRYPTO_STATS_PORT "com.android.trusty.hwcrypto.stats"
+
+/*
+ * HWCRYPTO_STATS_HIST_BUCKETS - number of latency histogram buckets
+ *
+ * Bucket 0 counts requests that completed in less than 2 microseconds, bucket
+ * n counts the ones that took from 2^n up to 2^(n + 1) microseconds, and the
+ * last bucket also counts everything slower.
+ */
+#define HWCRYPTO_STATS_HIST_BUCKETS 24
+
+/*
+ * HWCRYPTO_STATS_POOL_BASE - first id of the object pool statistics
+ *
+ * A &struct hwcrypto_stats_req with an @id of HWCRYPTO_STATS_POOL_BASE + n
+ * gets a &struct hwcrypto_stats_pool_rsp for the n-th preallocated object
+ * pool of the service instead of a &struct hwcrypto_stats_rsp.
+ */
+#define HWCRYPTO_STATS_POOL_BASE 0x100
+
+/*
+ * HWCRYPTO_STATS_POOL_NAME_LEN - size of &struct hwcrypto_stats_pool_rsp.name
+ */
+#define HWCRYPTO_STATS_POOL_NAME_LEN 24
+
+/**
+ * enum hwcrypto_stats_id - commands statistics are kept for
+ * @HWCRYPTO_STATS_HWRNG_GET:         &struct hwrng_req on %HWRNG_PORT
+ * @HWCRYPTO_STATS_HWRNG_DRBG:        &struct hwrng_req on %HWRNG_DRBG_PORT
+ * @HWCRYPTO_STATS_HWRNG_MEMREF:      &struct hwrng_memref_req on either port
+ * @HWCRYPTO_STATS_HWKEY_GET_KEYSLOT: %HWKEY_GET_KEYSLOT
+ * @HWCRYPTO_STATS_HWKEY_DERIVE:      %HWKEY_DERIVE
+ * @HWCRYPTO_STATS_HWKEY_BATCH:       %HWKEY_BATCH
+ * @HWCRYPTO_STATS_KEYBOX_UNWRAP:     %KEYBOX_CMD_UNWRAP
+ * @HWCRYPTO_STATS_COUNT:             number of commands
+ */
+enum hwcrypto_stats_id {
+    HWCRYPTO_STATS_HWRNG_GET,
+    HWCRYPTO_STATS_HWRNG_DRBG,
+    HWCRYPTO_STATS_HWRNG_MEMREF,
+    HWCRYPTO_STATS_HWKEY_GET_KEYSLOT,
+    HWCRYPTO_STATS_HWKEY_DERIVE,
+    HWCRYPTO_STATS_HWKEY_BATCH,
+    HWCRYPTO_STATS_KEYBOX_UNWRAP,
+    HWCRYPTO_STATS_COUNT,
+};
+
+/**
+ * struct hwcrypto_stats_req - get the statistics of one command
+ * @id:       &enum hwcrypto_stats_id of the command
+ * @reserved: must be 0
+ */
+struct hwcrypto_stats_req {
+    uint32_t id;
+    uint32_t reserved;
+};
+
+/**
+ * struct hwcrypto_stats_rsp - statistics of one command
+ * @status:   NO_ERROR, or ERR_NOT_FOUND if @id is not a known command
+ * @id:       @id of the request
+ * @count:    number of completed requests
+ * @errors:   number of requests in @count that failed
+ * @bytes:    random bytes served for hwrng commands, request payload bytes
+ *            for the others
+ * @total_ns: sum of the latencies of all requests in @count
+ * @max_ns:   highest latency of a single request
+ * @hist:     latency histogram, see %HWCRYPTO_STATS_HIST_BUCKETS
+ *
+ * Latency is measured from reading a request to sending its reply. For hwrng
+ * commands it starts when the request is queued.
+ */
+struct hwcrypto_stats_rsp {
+    int32_t status;
+    uint32_t id;
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t hist[HWCRYPTO_STATS_HIST_BUCKETS];
+};
+
+/**
+ * struct hwcrypto_stats_pool_rsp - usage of one object pool
+ * @status:     NO_ERROR, or ERR_NOT_FOUND if there is no pool with this @id
+ * @id:         @id of the request
+ * @name:       zero terminated name of the pool, truncated if too long
+ * @obj_size:   size of one object
+ * @capacity:   number of objects in the pool
+ * @used:       number of objects currently allocated
+ * @high_water: highest @used seen so far
+ * @failures:   number of allocations that failed because the pool was full
+ *
+ * A @high_water close to @capacity means the pool is sized too small for the
+ * load, one that stays far below it means it wastes heap.
+ */
+struct hwcrypto_stats_pool_rsp {
+    int32_t status;
+    uint32_t id;
+    char name[HWCRYPTO_STATS_POOL_NAME_LEN];
+    uint32_t obj_size;
+    uint32_t capacity;
+    uint32_t used;
+    uint32_t high_water;
+    uint64_t failures;
+};
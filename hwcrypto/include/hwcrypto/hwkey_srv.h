@@ -0,0 +1,80 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <interface/hwkey/hwkey.h>
+#include <stdint.h>
+
+/*
+ * Extensions to the HWKEY interface implemented by the sample hwcrypto
+ * service.
+ */
+
+/*
+ * HWKEY_KDF_VERSION_2 - HKDF-SHA256 with a caller-chosen output length
+ *
+ * Derives the same key material as %HWKEY_KDF_VERSION_1: the pseudorandom key
+ * extracted from the device key with the caller UUID as salt, expanded with
+ * the request payload as info. The output length is taken from
+ * &struct hwkey_msg.arg2 instead of being tied to the payload length, and a
+ * value of 0 keeps the %HWKEY_KDF_VERSION_1 behaviour. Since HKDF output is a
+ * prefix-stable stream, the first N bytes of a longer key equal the key of
+ * length N.
+ *
+ * %HWKEY_KDF_VERSION_BEST selects this version when the provider supports it.
+ */
+#define HWKEY_KDF_VERSION_2 2
+
+/*
+ * HWKEY_BATCH - run several requests in one message
+ *
+ * The payload of the request is a sequence of &struct hwkey_batch_entry
+ * sub-requests, &struct hwkey_msg.arg1 holds their number. Supported
+ * sub-requests are %HWKEY_GET_KEYSLOT, whose data is the NUL-terminated key
+ * id, and %HWKEY_DERIVE. The response carries one entry per sub-request in the
+ * same order, each with its own status, and the whole response payload is
+ * limited to %HWKEY_MAX_PAYLOAD_SIZE bytes like every other response. A
+ * sub-request whose result no longer fits fails with %HWKEY_ERR_BAD_LEN
+ * without affecting the others.
+ *
+ * The status in the response header is only set if the batch itself cannot be
+ * parsed, in which case no entries are returned.
+ */
+#define HWKEY_BATCH (16 << HWKEY_REQ_SHIFT)
+
+/* Largest request or response payload of the HWKEY service */
+#define HWKEY_MAX_PAYLOAD_SIZE 2048
+
+/**
+ * struct hwkey_batch_entry - sub-request or sub-response of %HWKEY_BATCH
+ * @cmd:    %HWKEY_GET_KEYSLOT or %HWKEY_DERIVE, with %HWKEY_RESP_BIT set in
+ *          the response
+ * @status: &enum hwkey_err result of the sub-request, 0 in requests
+ * @arg1:   same as &struct hwkey_msg.arg1 of the single request
+ * @arg2:   same as &struct hwkey_msg.arg2 of the single request
+ * @len:    number of bytes in @data
+ * @data:   key id, derivation input or returned key, padded with zeroes to a
+ *          multiple of 4 bytes before the next entry
+ */
+struct hwkey_batch_entry {
+    uint32_t cmd;
+    uint32_t status;
+    uint32_t arg1;
+    uint32_t arg2;
+    uint32_t len;
+    uint8_t data[0];
+};
@@ -19,6 +19,7 @@
 #include <lk/compiler.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <uapi/trusty_uuid.h>
 
 __BEGIN_CDECLS
 
@@ -39,8 +40,71 @@ int hwrng_dev_init(void);
  * @buf: buffer to be filled up
  * @buf_len: requested amount of random data
  *
+ * Providers that implement hwrng_dev_start_rng_data() need not support calls
+ * to this function while an asynchronous request is outstanding, hwcrypto
+ * never overlaps the two.
+ *
  * Return: NO_ERROR on success, a negative error code otherwise.
  */
 int hwrng_dev_get_rng_data(uint8_t* buf, size_t buf_len);
 
+/*
+ * hwrng_dev_done_t - completion callback of hwrng_dev_start_rng_data()
+ * @rc: NO_ERROR if the buffer has been filled, a negative error code otherwise
+ * @priv: opaque pointer passed to hwrng_dev_start_rng_data()
+ */
+typedef void (*hwrng_dev_done_t)(int rc, void* priv);
+
+/*
+ * The asynchronous interface below is optional. Providers that do not
+ * implement it get a default one that calls hwrng_dev_get_rng_data() and
+ * completes every request immediately.
+ */
+
+/*
+ * hwrng_dev_start_rng_data() - start filling a buffer with random data
+ * @buf: buffer to be filled up, must stay valid until @done is called
+ * @buf_len: requested amount of random data
+ * @done: completion callback
+ * @priv: opaque pointer passed to @done
+ *
+ * Only one request is outstanding at a time. @done is called exactly once
+ * from the hwcrypto event loop: either from the &struct tipc_event_handler the
+ * provider attached to its own waitable handle (e.g. an interrupt) with
+ * set_cookie(), from hwrng_dev_poll(), or before this function returns if the
+ * data is available right away.
+ *
+ * Return: NO_ERROR if the request has been started, a negative error code
+ * otherwise. @done is not called if the request could not be started.
+ */
+int hwrng_dev_start_rng_data(uint8_t* buf,
+                             size_t buf_len,
+                             hwrng_dev_done_t done,
+                             void* priv);
+
+/*
+ * hwrng_dev_poll() - complete asynchronous requests that are due
+ *
+ * Called by the hwcrypto event loop before it waits for events, for providers
+ * that cannot signal completion through a handle. hwcrypto also calls it in a
+ * loop when it has to wait for the outstanding request outside of the event
+ * loop, so every provider must complete a finished request from here, even
+ * if it also signals completion through a handle.
+ *
+ * Return: the maximum time in milliseconds the event loop may wait before
+ * calling hwrng_dev_poll() again, or INFINITE_TIME.
+ */
+uint32_t hwrng_dev_poll(void);
+
+/*
+ * hwrng_dev_get_client_quota() - get the request quota of a client
+ * @uuid: UUID of the client application
+ *
+ * Optional. The default grants every client %HWRNG_CLIENT_QUOTA bytes.
+ *
+ * Return: the maximum number of bytes the client may have outstanding across
+ * all of its HWRNG sessions.
+ */
+size_t hwrng_dev_get_client_quota(const uuid_t* uuid);
+
 __END_CDECLS
@@ -0,0 +1,76 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <interface/hwrng/hwrng.h>
+
+/*
+ * Extensions to the HWRNG interface implemented by the sample hwcrypto
+ * service.
+ */
+
+/*
+ * HWRNG_DRBG_PORT - port serving the output of an SP 800-90A CTR_DRBG that is
+ * seeded and periodically reseeded from the HWRNG device
+ *
+ * Uses the same &struct hwrng_req protocol as %HWRNG_PORT. Clients that need
+ * raw device entropy, e.g. to seed their own DRBG, should keep using
+ * %HWRNG_PORT, while bulk consumers of random data should prefer this port.
+ */
+#define HWRNG_DRBG_PORT "com.android.trusty.hwrng.drbg"
+
+/*
+ * HWRNG_MEMREF_MAX_SIZE - largest region a single memref fill request may
+ * cover
+ */
+#define HWRNG_MEMREF_MAX_SIZE (1024 * 1024)
+
+/*
+ * Quotas: the service bounds the number of bytes each channel and each client
+ * application may have outstanding. A memref request over the limit completes
+ * with ERR_BUSY and leaves the channel open. A plain &struct hwrng_req has no
+ * way to carry a status, so the service closes the channel instead.
+ */
+
+/**
+ * struct hwrng_memref_req - fill a shared memory buffer with random data
+ * @len:      number of bytes to fill, at most %HWRNG_MEMREF_MAX_SIZE
+ * @reserved: must be 0
+ *
+ * Sent on %HWRNG_PORT or %HWRNG_DRBG_PORT together with exactly one memref
+ * handle that covers at least @len bytes. The service maps the memref, fills
+ * the first @len bytes in place with data from the respective source and then
+ * replies with a single &struct hwrng_memref_rsp. The client must not touch
+ * the buffer until that reply arrives and must not send further requests on
+ * the channel in the meantime.
+ */
+struct hwrng_memref_req {
+    uint32_t len;
+    uint32_t reserved;
+};
+
+/**
+ * struct hwrng_memref_rsp - completion of a &struct hwrng_memref_req
+ * @status: NO_ERROR on success, ERR_BUSY if the request would exceed the
+ *          quota of the client and should be retried later, another negative
+ *          error code otherwise
+ * @len:    number of bytes that were filled
+ */
+struct hwrng_memref_rsp {
+    int32_t status;
+    uint32_t len;
+};
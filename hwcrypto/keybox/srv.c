@@ -24,17 +24,42 @@
 #include <string.h>
 #include <uapi/err.h>
 
+#include <hwcrypto_consts.h>
 #include <interface/keybox/keybox.h>
 
 #include <lib/tipc/tipc.h>
 #include <trusty_log.h>
 
+#include "../event_loop.h"
+#include "../send_queue.h"
+#include "../slab_pool.h"
+#include "../stats.h"
 #include "keybox.h"
 #include "srv.h"
 
+/*
+ * Number of requests a client can send on one channel before the service
+ * reads any of them. Can be overridden from the build configuration.
+ */
+#ifndef KEYBOX_PORT_QUEUE_LEN
+#define KEYBOX_PORT_QUEUE_LEN 2
+#endif
+
+/*
+ * Number of replies all Keybox channels together can have queued while their
+ * peers are not reading. Every slot holds an unwrapped keybox, about 2 KB,
+ * and is allocated at startup, so min_heap in manifest.json has to cover
+ * them. Can be overridden from the build configuration.
+ */
+#ifndef KEYBOX_SEND_QUEUE_SLOTS
+#define KEYBOX_SEND_QUEUE_SLOTS 2
+#endif
+
 struct keybox_chan_ctx {
     struct tipc_event_handler evt_handler;
     handle_t chan;
+    /* replies waiting for the peer to make room */
+    struct send_queue send_queue;
 };
 
 static void keybox_port_handler(const uevent_t* ev, void* priv);
@@ -42,13 +67,18 @@ static void keybox_chan_handler(const uevent_t* ev, void* priv);
 
 static handle_t keybox_port = INVALID_IPC_HANDLE;
 
+static struct slab_pool keybox_ctx_pool;
+static struct slab_pool keybox_reply_pool;
+
 static struct tipc_event_handler keybox_port_evt_handler = {
         .proc = keybox_port_handler,
 };
 
 static void keybox_shutdown(struct keybox_chan_ctx* ctx) {
+    send_queue_clear(&ctx->send_queue);
+    hwcrypto_cancel_events(ctx->chan);
     close(ctx->chan);
-    free(ctx);
+    slab_pool_free(&keybox_ctx_pool, ctx);
 }
 
 struct full_keybox_unwrap_req {
@@ -61,12 +91,16 @@ struct full_keybox_unwrap_resp {
     struct keybox_unwrap_resp unwrap_header;
 };
 
-static int keybox_handle_unwrap(handle_t chan,
+static int keybox_handle_unwrap(struct keybox_chan_ctx* ctx,
                                 struct full_keybox_unwrap_req* req,
                                 size_t req_size) {
+    int rc;
+    int64_t start_ns = hwcrypto_stats_now();
     struct full_keybox_unwrap_resp rsp = {
             .header.cmd = KEYBOX_CMD_UNWRAP | KEYBOX_CMD_RSP_BIT,
     };
+    size_t rsp_size = sizeof(rsp.header);
+    size_t output_size = 0;
 
     uint8_t output[KEYBOX_MAX_SIZE];
     if (req_size < sizeof(req->unwrap_header)) {
@@ -92,11 +126,15 @@ static int keybox_handle_unwrap(handle_t chan,
         goto out;
     }
 
-    return tipc_send2(chan, &rsp, sizeof(rsp), output,
-                      rsp.unwrap_header.unwrapped_keybox_len);
+    rsp_size = sizeof(rsp);
+    output_size = rsp.unwrap_header.unwrapped_keybox_len;
 
 out:
-    return tipc_send1(chan, &rsp, sizeof(rsp.header));
+    rc = send_queue_send2(&ctx->send_queue, ctx->chan, &rsp, rsp_size, output,
+                          output_size);
+    hwcrypto_stats_record(HWCRYPTO_STATS_KEYBOX_UNWRAP, start_ns, req_size,
+                          rc < 0 || rsp.header.status != KEYBOX_STATUS_SUCCESS);
+    return rc;
 }
 
 struct full_keybox_req {
@@ -106,20 +144,24 @@ struct full_keybox_req {
     } cmd_header;
 };
 
+/*
+ * Handle one queued request. Returns ERR_NO_MSG once the queue is empty.
+ */
 static int keybox_handle_msg(struct keybox_chan_ctx* ctx) {
     int rc;
     struct full_keybox_req req;
-    enum keybox_status status = KEYBOX_STATUS_SUCCESS;
     rc = tipc_recv1(ctx->chan, sizeof(req.header), &req, sizeof(req));
-    if (rc < 0) {
+    if (rc == ERR_NO_MSG) {
+        return rc;
+    } else if (rc < 0) {
         TLOGE("Failed (%d) to receive Keybox message\n", rc);
-        return KEYBOX_STATUS_INTERNAL_ERROR;
+        return rc;
     }
 
     size_t cmd_specific_size = (size_t)rc - sizeof(req.header);
     switch (req.header.cmd) {
     case KEYBOX_CMD_UNWRAP:
-        rc = keybox_handle_unwrap(ctx->chan, &req.cmd_header.unwrap,
+        rc = keybox_handle_unwrap(ctx, &req.cmd_header.unwrap,
                                   cmd_specific_size);
         break;
     default:
@@ -127,14 +169,11 @@ static int keybox_handle_msg(struct keybox_chan_ctx* ctx) {
         struct keybox_resp rsp;
         rsp.cmd = req.header.cmd | KEYBOX_CMD_RSP_BIT;
         rsp.status = KEYBOX_STATUS_INVALID_REQUEST;
-        rc = tipc_send1(ctx->chan, &rsp, sizeof(rsp));
-    }
-
-    if (rc < 0) {
-        status = KEYBOX_STATUS_INTERNAL_ERROR;
+        rc = send_queue_send2(&ctx->send_queue, ctx->chan, &rsp, sizeof(rsp),
+                              NULL, 0);
     }
 
-    return status;
+    return rc < 0 ? rc : NO_ERROR;
 }
 
 static void keybox_chan_handler(const uevent_t* ev, void* priv) {
@@ -143,12 +182,26 @@ static void keybox_chan_handler(const uevent_t* ev, void* priv) {
     assert(ev->handle == ctx->chan);
 
     tipc_handle_chan_errors(ev);
-    int rc = 0;
-    if (ev->event & IPC_HANDLE_POLL_MSG) {
-        rc = keybox_handle_msg(ctx);
-    }
     if (ev->event & IPC_HANDLE_POLL_HUP) {
         keybox_shutdown(ctx);
+        return;
+    }
+
+    int rc = 0;
+    if (ev->event & IPC_HANDLE_POLL_SEND_UNBLOCKED) {
+        rc = send_queue_flush(&ctx->send_queue, ctx->chan);
+        if (rc < 0) {
+            TLOGE("Failed (%d) to send queued Keybox replies\n", rc);
+        }
+    }
+    if (!rc && (ev->event & IPC_HANDLE_POLL_MSG)) {
+        /* read every request the client has queued up */
+        do {
+            rc = keybox_handle_msg(ctx);
+        } while (rc == NO_ERROR);
+        if (rc == ERR_NO_MSG) {
+            rc = NO_ERROR;
+        }
     }
     if (rc) {
         keybox_shutdown(ctx);
@@ -171,7 +224,7 @@ static void keybox_port_handler(const uevent_t* ev, void* priv) {
         }
         chan = (handle_t)rc;
 
-        struct keybox_chan_ctx* ctx = calloc(1, sizeof(struct keybox_chan_ctx));
+        struct keybox_chan_ctx* ctx = slab_pool_alloc(&keybox_ctx_pool);
 
         if (!ctx) {
             TLOGE("failed to alloc state for chan %d\n", chan);
@@ -183,12 +236,13 @@ static void keybox_port_handler(const uevent_t* ev, void* priv) {
         ctx->evt_handler.priv = ctx;
         ctx->evt_handler.proc = keybox_chan_handler;
         ctx->chan = chan;
+        send_queue_init(&ctx->send_queue, &keybox_reply_pool);
 
         /* attach channel handler */
         rc = set_cookie(chan, &ctx->evt_handler);
         if (rc) {
             TLOGE("failed (%d) to set_cookie on chan %d\n", rc, chan);
-            free(ctx);
+            slab_pool_free(&keybox_ctx_pool, ctx);
             close(chan);
             return;
         }
@@ -203,9 +257,29 @@ int keybox_start_service(void) {
 
     TLOGD("Start Keybox service\n");
 
+    /* unwrap requests are small and block their caller, serve them first */
+    hwcrypto_set_event_priority(keybox_port_handler, HWCRYPTO_EVENT_PRIO_HIGH);
+    hwcrypto_set_event_priority(keybox_chan_handler, HWCRYPTO_EVENT_PRIO_HIGH);
+
+    rc = slab_pool_init(&keybox_ctx_pool, "keybox_chan_ctx",
+                        sizeof(struct keybox_chan_ctx), KEYBOX_MAX_CHANNELS);
+    if (rc != NO_ERROR) {
+        TLOGE("Failed (%d) to allocate channel pool\n", rc);
+        return rc;
+    }
+
+    rc = send_queue_pool_init(
+            &keybox_reply_pool, "keybox_reply",
+            sizeof(struct full_keybox_unwrap_resp) + KEYBOX_MAX_SIZE,
+            KEYBOX_SEND_QUEUE_SLOTS);
+    if (rc != NO_ERROR) {
+        TLOGE("Failed (%d) to allocate reply pool\n", rc);
+        return rc;
+    }
+
     /* create Keybox port */
-    rc = port_create(KEYBOX_PORT, 1, sizeof(struct full_keybox_req),
-                     IPC_PORT_ALLOW_TA_CONNECT);
+    rc = port_create(KEYBOX_PORT, KEYBOX_PORT_QUEUE_LEN,
+                     sizeof(struct full_keybox_req), IPC_PORT_ALLOW_TA_CONNECT);
     if (rc < 0) {
         TLOGE("Failed (%d) to create port '%s'\n", rc, KEYBOX_PORT);
         goto cleanup;
@@ -18,19 +18,428 @@
 
 #include <assert.h>
 #include <inttypes.h>
+#include <lk/macros.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <uapi/err.h>
 
 #include <hwcrypto/hwrng_dev.h>
 #include <lib/tipc/tipc.h>
 #include <trusty_log.h>
 
+#include "event_loop.h"
 #include "hwkey_srv_priv.h"
 #include "hwrng_srv_priv.h"
+#include "slab_pool.h"
+#include "stats.h"
 
 #include "keybox/srv.h"
 
+/*
+ * Largest number of ready handles collected, and of times wait_any() is
+ * polled for them, after one wakeup before they are served. Can be overridden
+ * from the build configuration.
+ */
+#ifndef HWCRYPTO_MAX_EVENTS_PER_WAKEUP
+#define HWCRYPTO_MAX_EVENTS_PER_WAKEUP 16
+#endif
+
+/*
+ * Number of wakeups between two debug logs of the average number of events
+ * per wakeup. Can be overridden from the build configuration.
+ */
+#ifndef HWCRYPTO_EVENT_STATS_INTERVAL
+#define HWCRYPTO_EVENT_STATS_INTERVAL 1024
+#endif
+
+/* Largest number of handler procedures with a registered priority */
+#define HWCRYPTO_MAX_EVENT_PRIOS 8
+
+static struct {
+    void (*proc)(const uevent_t* ev, void* priv);
+    enum hwcrypto_event_prio prio;
+} event_prios[HWCRYPTO_MAX_EVENT_PRIOS];
+static size_t event_prio_cnt;
+
+/**
+ * struct pending_event - event collected for dispatch
+ * @ev:   the event, @ev.handle is %INVALID_IPC_HANDLE if it has been cancelled
+ * @prio: priority of the handler of @ev
+ */
+struct pending_event {
+    uevent_t ev;
+    enum hwcrypto_event_prio prio;
+};
+
+/* events of the current wakeup, ordered by priority */
+static struct pending_event pending[HWCRYPTO_MAX_EVENTS_PER_WAKEUP];
+static size_t pending_cnt;
+
+static struct {
+    uint64_t wakeups;
+    uint64_t events;
+} event_stats;
+
+static struct list_node self_tests = LIST_INITIAL_VALUE(self_tests);
+static int64_t self_tests_ns;
+
+void hwcrypto_set_event_priority(void (*proc)(const uevent_t* ev, void* priv),
+                                 enum hwcrypto_event_prio prio) {
+    assert(proc);
+
+    for (size_t i = 0; i < event_prio_cnt; i++) {
+        if (event_prios[i].proc == proc) {
+            event_prios[i].prio = prio;
+            return;
+        }
+    }
+
+    if (event_prio_cnt == countof(event_prios)) {
+        TLOGE("too many event handler priorities\n");
+        return;
+    }
+
+    event_prios[event_prio_cnt].proc = proc;
+    event_prios[event_prio_cnt].prio = prio;
+    event_prio_cnt++;
+}
+
+void hwcrypto_cancel_events(handle_t handle) {
+    for (size_t i = 0; i < pending_cnt; i++) {
+        if (pending[i].ev.handle == handle) {
+            pending[i].ev.handle = INVALID_IPC_HANDLE;
+            pending[i].ev.cookie = NULL;
+        }
+    }
+}
+
+void hwcrypto_get_event_stats(uint64_t* wakeups, uint64_t* events) {
+    assert(wakeups);
+    assert(events);
+
+    *wakeups = event_stats.wakeups;
+    *events = event_stats.events;
+}
+
+void hwcrypto_queue_self_test(struct hwcrypto_self_test* test) {
+    assert(test);
+    assert(test->run);
+
+    list_add_tail(&self_tests, &test->node);
+}
+
+bool hwcrypto_self_tests_done(void) {
+    return list_is_empty(&self_tests);
+}
+
+/*
+ * Run the oldest pending self test, a failure is fatal
+ */
+static void run_self_test(void) {
+    struct hwcrypto_self_test* test = list_peek_head_type(
+            &self_tests, struct hwcrypto_self_test, node);
+    if (!test)
+        return;
+
+    int64_t start_ns = hwcrypto_stats_now();
+    bool passed = test->run();
+    int64_t ns = hwcrypto_stats_now() - start_ns;
+
+    if (!passed) {
+        TLOGE("self test %s failed\n", test->name);
+        abort();
+    }
+
+    list_delete(&test->node);
+    self_tests_ns += ns;
+    TLOGI("self test %s passed in %" PRId64 " us\n", test->name, ns / 1000);
+
+    if (list_is_empty(&self_tests)) {
+        TLOGI("all self tests passed in %" PRId64 " us\n",
+              self_tests_ns / 1000);
+    }
+}
+
+static enum hwcrypto_event_prio event_priority(const uevent_t* ev) {
+    const struct tipc_event_handler* handler = ev->cookie;
+
+    if (handler) {
+        for (size_t i = 0; i < event_prio_cnt; i++) {
+            if (event_prios[i].proc == handler->proc)
+                return event_prios[i].prio;
+        }
+    }
+    return HWCRYPTO_EVENT_PRIO_DEFAULT;
+}
+
+static struct pending_event* find_pending_event(handle_t handle) {
+    for (size_t i = 0; i < pending_cnt; i++) {
+        if (pending[i].ev.handle == handle)
+            return &pending[i];
+    }
+    return NULL;
+}
+
+/*
+ * Add @ev behind all pending events of the same or higher priority
+ */
+static void add_pending_event(const uevent_t* ev) {
+    enum hwcrypto_event_prio prio = event_priority(ev);
+    size_t pos = pending_cnt;
+
+    assert(pending_cnt < countof(pending));
+
+    while (pos && pending[pos - 1].prio > prio) {
+        pending[pos] = pending[pos - 1];
+        pos--;
+    }
+    pending[pos].ev = *ev;
+    pending[pos].prio = prio;
+    pending_cnt++;
+}
+
+/*
+ * Wait up to @timeout for an event, then collect every other handle that is
+ * ready without blocking again.
+ *
+ * Nothing is assumed about the order in which wait_any() returns ready
+ * handles. A handle that has already been collected only adds its event
+ * flags, and the number of polls is bounded by the size of the batch, so a
+ * handle that is returned over and over cannot keep us here.
+ *
+ * Return: NO_ERROR if at least one event has been collected, ERR_TIMED_OUT or
+ * another error code from wait_any() otherwise.
+ */
+static int collect_events(uint32_t timeout) {
+    int rc;
+    uevent_t ev = {.handle = INVALID_IPC_HANDLE};
+
+    rc = wait_any(&ev, timeout);
+    if (rc != NO_ERROR)
+        return rc;
+
+    add_pending_event(&ev);
+
+    for (size_t polls = 1; polls < countof(pending); polls++) {
+        ev.handle = INVALID_IPC_HANDLE;
+        ev.event = 0;
+        ev.cookie = NULL;
+
+        if (wait_any(&ev, 0) != NO_ERROR)
+            break;
+
+        struct pending_event* dup = find_pending_event(ev.handle);
+        if (dup) {
+            dup->ev.event |= ev.event;
+            continue;
+        }
+
+        add_pending_event(&ev);
+    }
+
+    return NO_ERROR;
+}
+
+/**
+ * struct cmd_stats - statistics of one &enum hwcrypto_stats_id
+ * @count:    number of completed requests
+ * @errors:   number of failed requests
+ * @bytes:    number of bytes processed
+ * @total_ns: sum of all latencies
+ * @max_ns:   highest latency
+ * @hist:     log2 latency histogram in microseconds
+ */
+struct cmd_stats {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t hist[HWCRYPTO_STATS_HIST_BUCKETS];
+};
+
+static struct cmd_stats cmd_stats[HWCRYPTO_STATS_COUNT];
+
+uint64_t hwcrypto_stats_record(enum hwcrypto_stats_id id,
+                               int64_t start_ns,
+                               size_t bytes,
+                               bool error) {
+    assert(id < HWCRYPTO_STATS_COUNT);
+
+    struct cmd_stats* s = &cmd_stats[id];
+    uint64_t ns = (uint64_t)MAX(hwcrypto_stats_now() - start_ns, 0);
+    uint64_t us = ns / 1000;
+
+    /* floor(log2(us)) with one count-leading-zeros instruction */
+    unsigned int bucket = us > 1 ? 63 - __builtin_clzll(us) : 0;
+
+    s->count++;
+    s->errors += error;
+    s->bytes += bytes;
+    s->total_ns += ns;
+    s->max_ns = MAX(s->max_ns, ns);
+    s->hist[MIN(bucket, HWCRYPTO_STATS_HIST_BUCKETS - 1)]++;
+    return ns;
+}
+
+static void stats_port_handler(const uevent_t* ev, void* priv);
+static void stats_chan_handler(const uevent_t* ev, void* priv);
+
+static struct tipc_event_handler stats_port_evt_handler = {
+        .proc = stats_port_handler,
+};
+
+/* the stats service keeps no per-channel state */
+static struct tipc_event_handler stats_chan_evt_handler = {
+        .proc = stats_chan_handler,
+};
+
+static void stats_close_chan(handle_t chan) {
+    hwcrypto_cancel_events(chan);
+    close(chan);
+}
+
+/*
+ * Reply to a request for the statistics of an object pool
+ */
+static int stats_send_pool(handle_t chan,
+                           const struct hwcrypto_stats_req* req) {
+    int rc;
+    struct slab_pool_stats s;
+    struct hwcrypto_stats_pool_rsp rsp;
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.id = req->id;
+    rsp.status = ERR_NOT_FOUND;
+    if (!req->reserved &&
+        slab_pool_get_stats(req->id - HWCRYPTO_STATS_POOL_BASE, &s) ==
+                NO_ERROR) {
+        rsp.status = NO_ERROR;
+        if (s.name)
+            strncpy(rsp.name, s.name, sizeof(rsp.name) - 1);
+        rsp.obj_size = s.obj_size;
+        rsp.capacity = s.capacity;
+        rsp.used = s.used;
+        rsp.high_water = s.high_water;
+        rsp.failures = s.failures;
+    }
+
+    rc = tipc_send1(chan, &rsp, sizeof(rsp));
+    if (rc < 0)
+        return rc;
+    return NO_ERROR;
+}
+
+/*
+ * Reply to one statistics request
+ */
+static int stats_handle_msg(handle_t chan) {
+    int rc;
+    struct hwcrypto_stats_req req;
+    struct hwcrypto_stats_rsp rsp;
+
+    rc = tipc_recv1(chan, sizeof(req), &req, sizeof(req));
+    if (rc < 0)
+        return rc;
+
+    if (req.id >= HWCRYPTO_STATS_POOL_BASE)
+        return stats_send_pool(chan, &req);
+
+    memset(&rsp, 0, sizeof(rsp));
+    rsp.id = req.id;
+    if (req.reserved || req.id >= HWCRYPTO_STATS_COUNT) {
+        rsp.status = ERR_NOT_FOUND;
+    } else {
+        const struct cmd_stats* s = &cmd_stats[req.id];
+
+        rsp.status = NO_ERROR;
+        rsp.count = s->count;
+        rsp.errors = s->errors;
+        rsp.bytes = s->bytes;
+        rsp.total_ns = s->total_ns;
+        rsp.max_ns = s->max_ns;
+        memcpy(rsp.hist, s->hist, sizeof(rsp.hist));
+    }
+
+    rc = tipc_send1(chan, &rsp, sizeof(rsp));
+    if (rc < 0)
+        return rc;
+    return NO_ERROR;
+}
+
+static void stats_chan_handler(const uevent_t* ev, void* priv) {
+    tipc_handle_chan_errors(ev);
+
+    if (ev->event & IPC_HANDLE_POLL_HUP) {
+        stats_close_chan(ev->handle);
+        return;
+    }
+
+    if (ev->event & IPC_HANDLE_POLL_MSG) {
+        int rc;
+        do {
+            rc = stats_handle_msg(ev->handle);
+        } while (rc == NO_ERROR);
+        if (rc != ERR_NO_MSG) {
+            TLOGE("failed (%d) to handle stats request on chan %d\n", rc,
+                  ev->handle);
+            stats_close_chan(ev->handle);
+        }
+    }
+}
+
+static void stats_port_handler(const uevent_t* ev, void* priv) {
+    uuid_t peer_uuid;
+
+    tipc_handle_port_errors(ev);
+
+    if (ev->event & IPC_HANDLE_POLL_READY) {
+        int rc = accept(ev->handle, &peer_uuid);
+        if (rc < 0) {
+            TLOGE("failed (%d) to accept on port %d\n", rc, ev->handle);
+            return;
+        }
+
+        handle_t chan = (handle_t)rc;
+        rc = set_cookie(chan, &stats_chan_evt_handler);
+        if (rc) {
+            TLOGE("failed (%d) to set_cookie on chan %d\n", rc, chan);
+            close(chan);
+            return;
+        }
+    }
+}
+
+/*
+ *  Initialize statistics service
+ */
+static int stats_start_service(void) {
+    int rc;
+
+    /* statistics must never delay actual requests */
+    hwcrypto_set_event_priority(stats_port_handler, HWCRYPTO_EVENT_PRIO_BULK);
+    hwcrypto_set_event_priority(stats_chan_handler, HWCRYPTO_EVENT_PRIO_BULK);
+
+    rc = port_create(HWCRYPTO_STATS_PORT, 1, sizeof(struct hwcrypto_stats_req),
+                     IPC_PORT_ALLOW_TA_CONNECT);
+    if (rc < 0) {
+        TLOGE("Failed (%d) to create port '%s'\n", rc, HWCRYPTO_STATS_PORT);
+        return rc;
+    }
+
+    handle_t port = (handle_t)rc;
+    rc = set_cookie(port, &stats_port_evt_handler);
+    if (rc) {
+        TLOGE("failed (%d) to set_cookie on port %d\n", rc, port);
+        close(port);
+        return rc;
+    }
+
+    return NO_ERROR;
+}
+
 /*
  *  Dispatch event
  */
@@ -55,17 +464,44 @@ static void dispatch_event(const uevent_t* ev) {
     TLOGE("no handler for event (0x%x) with handle %d\n", ev->event,
           ev->handle);
 
+    hwcrypto_cancel_events(ev->handle);
     close(ev->handle);
 
     return;
 }
 
+/*
+ * Dispatch all collected events in priority order
+ */
+static void dispatch_events(void) {
+    event_stats.wakeups++;
+
+    for (size_t i = 0; i < pending_cnt; i++) {
+        /* a handler may cancel later events, or this one while it runs */
+        uevent_t ev = pending[i].ev;
+
+        if (ev.handle == INVALID_IPC_HANDLE)
+            continue;
+
+        dispatch_event(&ev);
+        event_stats.events++;
+    }
+    pending_cnt = 0;
+
+    if (event_stats.wakeups % HWCRYPTO_EVENT_STATS_INTERVAL == 0) {
+        TLOGD("%" PRIu64 " events in %" PRIu64 " wakeups, %" PRIu64
+              ".%02" PRIu64 " per wakeup\n",
+              event_stats.events, event_stats.wakeups,
+              event_stats.events / event_stats.wakeups,
+              event_stats.events * 100 / event_stats.wakeups % 100);
+    }
+}
+
 /*
  *  Main application event loop
  */
 int main(void) {
     int rc;
-    uevent_t event;
 
     TLOGD("Initializing\n");
 
@@ -83,23 +519,46 @@ int main(void) {
         goto out;
     }
 
+    /* the services work without it, so only complain */
+    rc = stats_start_service();
+    if (rc != NO_ERROR) {
+        TLOGE("Failed (%d) to initialize statistics service\n", rc);
+    }
+
     TLOGD("enter main event loop\n");
 
     /* enter main event loop */
     while (1) {
-        event.handle = INVALID_IPC_HANDLE;
-        event.event = 0;
-        event.cookie = NULL;
+        /* let the HWRNG device complete requests that are due */
+        uint32_t timeout = hwrng_dev_poll();
+
+        /* wipe cached keys on time even if hwcrypto is otherwise idle */
+        timeout = MIN(timeout, hwkey_derived_cache_expire());
 
-        rc = wait_any(&event, INFINITE_TIME);
+        /* only block if there is no idle work or self test to do */
+        bool self_test = !hwcrypto_self_tests_done();
+        bool idle_work = hwrng_reservoir_needs_refill();
+        if (self_test || idle_work)
+            timeout = 0;
+
+        rc = collect_events(timeout);
+        if (rc == ERR_TIMED_OUT) {
+            if (self_test)
+                run_self_test();
+            else if (idle_work)
+                hwrng_reservoir_refill();
+            continue;
+        }
         if (rc < 0) {
             TLOGE("wait_any failed (%d)\n", rc);
             break;
         }
 
-        if (rc == NO_ERROR) { /* got an event */
-            dispatch_event(&event);
-        }
+        dispatch_events();
+
+        /* requests held back for the tests keep us busy, so never skip one */
+        if (self_test)
+            run_self_test();
     }
 
 out:
@@ -27,10 +27,125 @@ MODULE_INCLUDES := $(LOCAL_DIR)/include
 MODULE_SRCS := \
 	$(LOCAL_DIR)/main.c \
 	$(LOCAL_DIR)/hwrng_srv.c \
+	$(LOCAL_DIR)/hwrng_drbg.c \
+	$(LOCAL_DIR)/hwrng_health.c \
+	$(LOCAL_DIR)/hwrng_dev_sync.c \
 	$(LOCAL_DIR)/hwkey_srv.c \
+	$(LOCAL_DIR)/hwkey_slot_index.c \
+	$(LOCAL_DIR)/hwkey_derived_cache.c \
+	$(LOCAL_DIR)/send_queue.c \
+	$(LOCAL_DIR)/slab_pool.c \
 
 ifeq (true,$(call TOBOOL,$(WITH_FAKE_HWRNG)))
 MODULE_SRCS += $(LOCAL_DIR)/hwrng_srv_fake_provider.c
+ifneq ($(HWRNG_FAKE_SEED),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_FAKE_SEED=$(HWRNG_FAKE_SEED)
+endif
+ifneq ($(HWRNG_FAKE_LATENCY_MS),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_FAKE_LATENCY_MS=$(HWRNG_FAKE_LATENCY_MS)
+endif
+endif
+
+ifneq ($(HWRNG_RESERVOIR_PAGES),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_RESERVOIR_PAGES=$(HWRNG_RESERVOIR_PAGES)
+endif
+
+ifneq ($(HWRNG_DRBG_RESEED_INTERVAL),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_DRBG_RESEED_INTERVAL=$(HWRNG_DRBG_RESEED_INTERVAL)
+endif
+
+ifneq ($(HWRNG_CHAN_MAX_PENDING),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_CHAN_MAX_PENDING=$(HWRNG_CHAN_MAX_PENDING)
+endif
+
+ifneq ($(HWRNG_CLIENT_QUOTA),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_CLIENT_QUOTA=$(HWRNG_CLIENT_QUOTA)
+endif
+
+ifneq ($(HWRNG_HEALTH_ENTROPY_BITS),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_HEALTH_ENTROPY_BITS=$(HWRNG_HEALTH_ENTROPY_BITS)
+endif
+
+ifeq (true,$(call TOBOOL,$(WITH_HWRNG_HEALTH_BENCHMARK)))
+MODULE_COMPILEFLAGS += \
+	-DWITH_HWRNG_HEALTH_BENCHMARK=1
+endif
+
+ifneq ($(HWRNG_SCHED_QUANTUM),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_SCHED_QUANTUM=$(HWRNG_SCHED_QUANTUM)
+endif
+
+ifneq ($(HWKEY_DERIVED_CACHE_SIZE),)
+MODULE_COMPILEFLAGS += \
+	-DHWKEY_DERIVED_CACHE_SIZE=$(HWKEY_DERIVED_CACHE_SIZE)
+endif
+
+ifneq ($(HWKEY_DERIVED_CACHE_TTL_MS),)
+MODULE_COMPILEFLAGS += \
+	-DHWKEY_DERIVED_CACHE_TTL_MS=$(HWKEY_DERIVED_CACHE_TTL_MS)
+endif
+
+ifneq ($(HWRNG_PORT_QUEUE_LEN),)
+MODULE_COMPILEFLAGS += \
+	-DHWRNG_PORT_QUEUE_LEN=$(HWRNG_PORT_QUEUE_LEN)
+endif
+
+ifneq ($(HWKEY_PORT_QUEUE_LEN),)
+MODULE_COMPILEFLAGS += \
+	-DHWKEY_PORT_QUEUE_LEN=$(HWKEY_PORT_QUEUE_LEN)
+endif
+
+ifneq ($(KEYBOX_PORT_QUEUE_LEN),)
+MODULE_COMPILEFLAGS += \
+	-DKEYBOX_PORT_QUEUE_LEN=$(KEYBOX_PORT_QUEUE_LEN)
+endif
+
+ifneq ($(HWCRYPTO_SEND_QUEUE_MAX),)
+MODULE_COMPILEFLAGS += \
+	-DHWCRYPTO_SEND_QUEUE_MAX=$(HWCRYPTO_SEND_QUEUE_MAX)
+endif
+
+ifneq ($(HWKEY_SEND_QUEUE_SLOTS),)
+MODULE_COMPILEFLAGS += \
+	-DHWKEY_SEND_QUEUE_SLOTS=$(HWKEY_SEND_QUEUE_SLOTS)
+endif
+
+ifneq ($(KEYBOX_SEND_QUEUE_SLOTS),)
+MODULE_COMPILEFLAGS += \
+	-DKEYBOX_SEND_QUEUE_SLOTS=$(KEYBOX_SEND_QUEUE_SLOTS)
+endif
+
+ifneq ($(HWKEY_CHAN_MAX_PENDING),)
+MODULE_COMPILEFLAGS += \
+	-DHWKEY_CHAN_MAX_PENDING=$(HWKEY_CHAN_MAX_PENDING)
+endif
+
+ifneq ($(HWKEY_MAX_ASYNC_REQS),)
+MODULE_COMPILEFLAGS += \
+	-DHWKEY_MAX_ASYNC_REQS=$(HWKEY_MAX_ASYNC_REQS)
+endif
+
+ifneq ($(HWCRYPTO_MAX_EVENTS_PER_WAKEUP),)
+MODULE_COMPILEFLAGS += \
+	-DHWCRYPTO_MAX_EVENTS_PER_WAKEUP=$(HWCRYPTO_MAX_EVENTS_PER_WAKEUP)
+endif
+
+ifneq ($(HWCRYPTO_EVENT_STATS_INTERVAL),)
+MODULE_COMPILEFLAGS += \
+	-DHWCRYPTO_EVENT_STATS_INTERVAL=$(HWCRYPTO_EVENT_STATS_INTERVAL)
+endif
+
+ifeq (true,$(call TOBOOL,$(WITH_HWKEY_OPAQUE_BENCHMARK)))
+MODULE_COMPILEFLAGS += \
+	-DWITH_HWKEY_OPAQUE_BENCHMARK=1
 endif
 
 ifeq (true,$(call TOBOOL,$(WITH_FAKE_HWKEY)))
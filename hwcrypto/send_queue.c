@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "send_queue"
+
+#include <assert.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include <lib/tipc/tipc.h>
+#include <openssl/mem.h>
+#include <trusty_log.h>
+
+#include "send_queue.h"
+
+/*
+ * Number of replies a channel may have queued before the peer is considered
+ * stuck. Can be overridden from the build configuration.
+ */
+#ifndef HWCRYPTO_SEND_QUEUE_MAX
+#define HWCRYPTO_SEND_QUEUE_MAX 4
+#endif
+
+struct send_queue_msg {
+    struct list_node node;
+    size_t len;
+    uint8_t data[];
+};
+
+static void send_queue_free_msg(struct send_queue* q,
+                                struct send_queue_msg* msg) {
+    list_delete(&msg->node);
+    q->cnt--;
+    /* replies carry key material */
+    OPENSSL_cleanse(msg, sizeof(*msg) + msg->len);
+    slab_pool_free(q->pool, msg);
+}
+
+static int send_queue_add(struct send_queue* q,
+                          const void* hdr,
+                          size_t hdr_len,
+                          const void* payload,
+                          size_t payload_len) {
+    if (q->cnt >= HWCRYPTO_SEND_QUEUE_MAX) {
+        TLOGE("send queue full\n");
+        return ERR_NOT_ENOUGH_BUFFER;
+    }
+
+    if (sizeof(struct send_queue_msg) + hdr_len + payload_len >
+        q->pool->obj_size) {
+        TLOGE("reply (%zu bytes) too large to queue\n", hdr_len + payload_len);
+        return ERR_TOO_BIG;
+    }
+
+    /* the slots are shared by all channels of the service */
+    struct send_queue_msg* msg = slab_pool_alloc(q->pool);
+    if (!msg)
+        return ERR_NOT_ENOUGH_BUFFER;
+
+    msg->len = hdr_len + payload_len;
+    memcpy(msg->data, hdr, hdr_len);
+    if (payload_len)
+        memcpy(msg->data + hdr_len, payload, payload_len);
+
+    list_add_tail(&q->msgs, &msg->node);
+    q->cnt++;
+    return NO_ERROR;
+}
+
+int send_queue_pool_init(struct slab_pool* pool,
+                         const char* name,
+                         size_t max_len,
+                         unsigned int cnt) {
+    return slab_pool_init(pool, name, sizeof(struct send_queue_msg) + max_len,
+                          cnt);
+}
+
+void send_queue_init(struct send_queue* q, struct slab_pool* pool) {
+    assert(pool);
+
+    list_initialize(&q->msgs);
+    q->cnt = 0;
+    q->pool = pool;
+}
+
+int send_queue_send2(struct send_queue* q,
+                     handle_t chan,
+                     const void* hdr,
+                     size_t hdr_len,
+                     const void* payload,
+                     size_t payload_len) {
+    int rc;
+
+    assert(hdr);
+    assert(payload || !payload_len);
+
+    if (!send_queue_empty(q))
+        return send_queue_add(q, hdr, hdr_len, payload, payload_len);
+
+    rc = tipc_send2(chan, hdr, hdr_len, payload, payload_len);
+    if (rc == ERR_NOT_ENOUGH_BUFFER)
+        return send_queue_add(q, hdr, hdr_len, payload, payload_len);
+    if (rc < 0)
+        return rc;
+    if ((size_t)rc != hdr_len + payload_len)
+        return ERR_BAD_LEN;
+
+    return NO_ERROR;
+}
+
+int send_queue_flush(struct send_queue* q, handle_t chan) {
+    struct send_queue_msg* msg;
+    struct send_queue_msg* temp;
+
+    list_for_every_entry_safe(&q->msgs, msg, temp, struct send_queue_msg,
+                              node) {
+        int rc = tipc_send1(chan, msg->data, msg->len);
+        if (rc == ERR_NOT_ENOUGH_BUFFER)
+            return NO_ERROR; /* wait for the next SEND_UNBLOCKED */
+        if (rc < 0)
+            return rc;
+        if ((size_t)rc != msg->len)
+            return ERR_BAD_LEN;
+
+        send_queue_free_msg(q, msg);
+    }
+
+    return NO_ERROR;
+}
+
+void send_queue_clear(struct send_queue* q) {
+    struct send_queue_msg* msg;
+    struct send_queue_msg* temp;
+
+    list_for_every_entry_safe(&q->msgs, msg, temp, struct send_queue_msg,
+                              node) {
+        send_queue_free_msg(q, msg);
+    }
+}
@@ -0,0 +1,117 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <trusty_ipc.h>
+
+#include "slab_pool.h"
+
+__BEGIN_CDECLS
+
+/**
+ * struct send_queue - replies waiting for room on a channel
+ * @msgs: queued messages, oldest first
+ * @cnt:  number of entries in @msgs
+ * @pool: pool the queued messages are copied to
+ *
+ * A reply that does not fit into the receive buffers of the peer is kept here
+ * until the channel reports %IPC_HANDLE_POLL_SEND_UNBLOCKED, instead of
+ * closing the channel. Replies sent while others are queued are queued behind
+ * them to keep the order.
+ *
+ * Queued replies never come from the heap. Every service preallocates a pool
+ * of reply slots shared by all of its channels with send_queue_pool_init(),
+ * so the memory set aside for replies is fixed and accounted for in
+ * min_heap, and running out of heap elsewhere cannot cost a channel its
+ * replies.
+ */
+struct send_queue {
+    struct list_node msgs;
+    unsigned int cnt;
+    struct slab_pool* pool;
+};
+
+/**
+ * send_queue_pool_init() - preallocate the reply slots of a service
+ * @pool:    pool to initialize
+ * @name:    name of the pool, must stay valid
+ * @max_len: length of the largest reply of the service
+ * @cnt:     number of replies all channels of the service can have queued
+ *
+ * Return: NO_ERROR on success, a negative error code otherwise.
+ */
+int send_queue_pool_init(struct slab_pool* pool,
+                         const char* name,
+                         size_t max_len,
+                         unsigned int cnt);
+
+/**
+ * send_queue_init() - initialize the queue of a channel
+ * @q:    queue to initialize
+ * @pool: reply slots of the service, from send_queue_pool_init()
+ */
+void send_queue_init(struct send_queue* q, struct slab_pool* pool);
+
+/**
+ * send_queue_send2() - send a reply or queue it if the channel is full
+ * @q:           queue of @chan
+ * @chan:        channel to send on
+ * @hdr:         first part of the reply
+ * @hdr_len:     length of @hdr
+ * @payload:     second part of the reply, may be NULL if @payload_len is 0
+ * @payload_len: length of @payload
+ *
+ * Queued replies are copied, the caller may reuse and wipe its buffers as soon
+ * as this returns.
+ *
+ * Return: NO_ERROR if the reply has been sent or queued. ERR_NOT_ENOUGH_BUFFER
+ * if the peer does not read its replies and the queue is full or all reply
+ * slots of the service are taken, another negative error code if sending
+ * failed. The caller should close the channel on errors.
+ */
+int send_queue_send2(struct send_queue* q,
+                     handle_t chan,
+                     const void* hdr,
+                     size_t hdr_len,
+                     const void* payload,
+                     size_t payload_len);
+
+/**
+ * send_queue_flush() - send queued replies after %IPC_HANDLE_POLL_SEND_UNBLOCKED
+ * @q:    queue of @chan
+ * @chan: channel to send on
+ *
+ * Return: NO_ERROR if the queue has been emptied or the channel is full again,
+ * a negative error code if sending failed.
+ */
+int send_queue_flush(struct send_queue* q, handle_t chan);
+
+/**
+ * send_queue_clear() - zero and drop all queued replies
+ * @q: queue to clear
+ */
+void send_queue_clear(struct send_queue* q);
+
+static inline bool send_queue_empty(const struct send_queue* q) {
+    return !q->cnt;
+}
+
+__END_CDECLS
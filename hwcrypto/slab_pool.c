@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define TLOG_TAG "slab_pool"
+
+#include <assert.h>
+#include <lk/macros.h>
+#include <stdlib.h>
+#include <string.h>
+#include <uapi/err.h>
+
+#include <trusty_log.h>
+
+#include "slab_pool.h"
+
+static struct list_node slab_pools = LIST_INITIAL_VALUE(slab_pools);
+
+int slab_pool_init(struct slab_pool* pool,
+                   const char* name,
+                   size_t obj_size,
+                   unsigned int capacity) {
+    assert(pool);
+    assert(!pool->mem);
+
+    if (!obj_size || !capacity)
+        return ERR_INVALID_ARGS;
+
+    obj_size = round_up(MAX(obj_size, sizeof(void*)), _Alignof(max_align_t));
+    if (obj_size > SIZE_MAX / capacity)
+        return ERR_INVALID_ARGS;
+
+    pool->mem = calloc(capacity, obj_size);
+    if (!pool->mem) {
+        TLOGE("failed to allocate %u objects for pool %s\n", capacity, name);
+        return ERR_NO_MEMORY;
+    }
+
+    pool->name = name;
+    pool->obj_size = obj_size;
+    pool->capacity = capacity;
+    pool->used = 0;
+    pool->high_water = 0;
+    pool->failures = 0;
+
+    /* thread the free list through the objects, lowest address first */
+    pool->free_list = NULL;
+    for (unsigned int i = capacity; i > 0; i--) {
+        void* obj = pool->mem + (size_t)(i - 1) * obj_size;
+        *(void**)obj = pool->free_list;
+        pool->free_list = obj;
+    }
+
+    list_add_tail(&slab_pools, &pool->node);
+    return NO_ERROR;
+}
+
+void* slab_pool_alloc(struct slab_pool* pool) {
+    assert(pool);
+
+    void* obj = pool->free_list;
+    if (!obj) {
+        pool->failures++;
+        TLOGE("pool %s exhausted (%u objects)\n",
+              pool->name ? pool->name : "(uninitialized)", pool->capacity);
+        return NULL;
+    }
+
+    pool->free_list = *(void**)obj;
+    pool->used++;
+    pool->high_water = MAX(pool->high_water, pool->used);
+
+    memset(obj, 0, pool->obj_size);
+    return obj;
+}
+
+void slab_pool_free(struct slab_pool* pool, void* obj) {
+    assert(pool);
+
+    if (!obj)
+        return;
+
+    assert((uint8_t*)obj >= pool->mem &&
+           (uint8_t*)obj < pool->mem + pool->capacity * pool->obj_size);
+    assert(((uint8_t*)obj - pool->mem) % pool->obj_size == 0);
+    assert(pool->used);
+
+    *(void**)obj = pool->free_list;
+    pool->free_list = obj;
+    pool->used--;
+}
+
+int slab_pool_get_stats(size_t idx, struct slab_pool_stats* stats) {
+    struct slab_pool* pool;
+
+    assert(stats);
+
+    list_for_every_entry(&slab_pools, pool, struct slab_pool, node) {
+        if (!idx--) {
+            stats->name = pool->name;
+            stats->obj_size = pool->obj_size;
+            stats->capacity = pool->capacity;
+            stats->used = pool->used;
+            stats->high_water = pool->high_water;
+            stats->failures = pool->failures;
+            return NO_ERROR;
+        }
+    }
+    return ERR_NOT_FOUND;
+}
@@ -0,0 +1,111 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <lk/list.h>
+#include <stddef.h>
+#include <stdint.h>
+
+__BEGIN_CDECLS
+
+/**
+ * struct slab_pool - fixed number of equally sized objects
+ * @node:       entry in the list of all pools, for slab_pool_get_stats()
+ * @name:       name reported in statistics and logs
+ * @mem:        storage of all objects, allocated once by slab_pool_init()
+ * @obj_size:   size of one object, rounded up for alignment
+ * @capacity:   number of objects in @mem
+ * @free_list:  first free object, every free object starts with a pointer to
+ *              the next one
+ * @used:       number of allocated objects
+ * @high_water: highest @used seen so far
+ * @failures:   number of allocations that failed because the pool was full
+ *
+ * Objects that are allocated and freed on every connect and disconnect come
+ * from a pool instead of the heap, so connection churn does not fragment the
+ * heap and allocation and freeing are a couple of pointer updates.
+ */
+struct slab_pool {
+    struct list_node node;
+    const char* name;
+    uint8_t* mem;
+    size_t obj_size;
+    unsigned int capacity;
+    void* free_list;
+    unsigned int used;
+    unsigned int high_water;
+    uint64_t failures;
+};
+
+/**
+ * struct slab_pool_stats - usage of a &struct slab_pool
+ * @name:       name of the pool
+ * @obj_size:   size of one object
+ * @capacity:   number of objects in the pool
+ * @used:       number of allocated objects
+ * @high_water: highest @used seen so far
+ * @failures:   number of allocations that failed because the pool was full
+ */
+struct slab_pool_stats {
+    const char* name;
+    size_t obj_size;
+    unsigned int capacity;
+    unsigned int used;
+    unsigned int high_water;
+    uint64_t failures;
+};
+
+/**
+ * slab_pool_init() - allocate the storage of a pool
+ * @pool:     pool to initialize
+ * @name:     name of the pool, must stay valid
+ * @obj_size: size of one object
+ * @capacity: number of objects
+ *
+ * Return: NO_ERROR on success, ERR_INVALID_ARGS or ERR_NO_MEMORY otherwise.
+ */
+int slab_pool_init(struct slab_pool* pool,
+                   const char* name,
+                   size_t obj_size,
+                   unsigned int capacity);
+
+/**
+ * slab_pool_alloc() - allocate a zeroed object
+ * @pool: pool to allocate from
+ *
+ * Return: the object, or NULL if the pool is full or not initialized.
+ */
+void* slab_pool_alloc(struct slab_pool* pool);
+
+/**
+ * slab_pool_free() - return an object to its pool
+ * @pool: pool @obj was allocated from
+ * @obj:  object to free, may be NULL
+ */
+void slab_pool_free(struct slab_pool* pool, void* obj);
+
+/**
+ * slab_pool_get_stats() - get usage of one pool
+ * @idx:   index of the pool, starting at 0
+ * @stats: filled in on success
+ *
+ * Return: NO_ERROR on success, ERR_NOT_FOUND if @idx is past the last pool.
+ */
+int slab_pool_get_stats(size_t idx, struct slab_pool_stats* stats);
+
+__END_CDECLS
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2026 The Android Open Source Project
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *      http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#pragma once
+
+#include <lk/compiler.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <hwcrypto/hwcrypto_stats.h>
+#include <trusty/time.h>
+
+__BEGIN_CDECLS
+
+/*
+ * hwcrypto_stats_now() - get the start time of a request
+ */
+static inline int64_t hwcrypto_stats_now(void) {
+    int64_t now = 0;
+    trusty_gettime(0, &now);
+    return now;
+}
+
+/**
+ * hwcrypto_stats_record() - account for a completed request
+ * @id:       command of the request
+ * @start_ns: time the request started, from hwcrypto_stats_now()
+ * @bytes:    bytes to add to &struct hwcrypto_stats_rsp.bytes
+ * @error:    true if the request failed
+ *
+ * Reads the current time once, everything else is a handful of additions.
+ *
+ * Return: the latency of the request in nanoseconds, for callers that keep
+ * statistics of their own and should not read the time again.
+ */
+uint64_t hwcrypto_stats_record(enum hwcrypto_stats_id id,
+                               int64_t start_ns,
+                               size_t bytes,
+                               bool error);
+
+__END_CDECLS